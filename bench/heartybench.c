@@ -0,0 +1,563 @@
+/**
+ * @file heartybench.c
+ * @brief Userspace load generator and latency benchmark for heartydev.
+ *
+ * Every thread opens the device once per mode of the mix, then issues
+ * reads and writes at offset 0 for a fixed time. Each operation is timed
+ * on its own, and at the end the throughput and the latency percentiles
+ * of reads and writes are printed.
+ *
+ * Build with `make bench`, then for example:
+ *
+ *     ./bench/heartybench -t 4 -s readv -w 4096 -r 65536 -m normal,upper
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>          // for errno
+#include <fcntl.h>          // for open
+#include <getopt.h>         // for getopt
+#include <linux/io_uring.h> // for struct io_uring_params
+#include <pthread.h>        // for pthread_create
+#include <stdint.h>         // for uint64_t
+#include <stdio.h>          // for printf
+#include <stdlib.h>         // for malloc and qsort
+#include <string.h>         // for memcpy and strcmp
+#include <sys/ioctl.h>      // for ioctl
+#include <sys/mman.h>       // for mmap
+#include <sys/syscall.h>    // for SYS_io_uring_setup
+#include <sys/uio.h>        // for preadv and pwritev
+#include <time.h>           // for clock_gettime
+#include <unistd.h>         // for pread and pwrite
+
+#include "../heartydev.h"
+
+#define MAX_MODES 3
+#define MAX_IOVS 64
+#define DEFAULT_DEVICE "/dev/heartydev"
+
+enum style { STYLE_RW, STYLE_READV, STYLE_MMAP, STYLE_URING };
+
+static const char *const style_names[] = {
+    [STYLE_RW] = "rw", [STYLE_READV] = "readv",
+    [STYLE_MMAP] = "mmap", [STYLE_URING] = "uring",
+};
+
+static const char *const mode_names[] = {
+    [HEARTYDEV_NORMAL] = "normal", [HEARTYDEV_UPPER] = "upper",
+    [HEARTYDEV_LOWER] = "lower",
+};
+
+/* the options of a run, shared read-only by all threads */
+struct config {
+    const char *device;
+    size_t write_size;
+    size_t read_size;
+    unsigned int reads_per_write;
+    unsigned int threads;
+    unsigned int seconds;
+    unsigned int iovs;
+    enum style style;
+    int modes[MAX_MODES];
+    unsigned int nr_modes;
+};
+
+/* latencies of one kind of operation, in nanoseconds */
+struct samples {
+    uint64_t *ns;
+    size_t nr;
+    size_t cap;
+    uint64_t bytes;
+};
+
+/* a minimal io_uring with a single submission in flight */
+struct ring {
+    int fd;
+    void *sq, *cq;          /* the mappings, NULL or MAP_FAILED if absent */
+    size_t sq_len, cq_len, sqes_len;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+struct worker {
+    pthread_t thread;
+    const struct config *cfg;
+    struct samples reads;
+    struct samples writes;
+    int error;
+};
+
+static volatile int stop;
+
+/**
+ * @brief Read the monotonic clock
+ *
+ * @return uint64_t the time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Record one operation
+ *
+ * @param s the samples
+ * @param ns the latency of the operation
+ * @param bytes the bytes it moved
+ * @return int 0 if successful, -1 if out of memory
+ */
+static int samples_add(struct samples *s, uint64_t ns, size_t bytes) {
+    uint64_t *grown;
+
+    if (s->nr == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 4096;
+        grown = realloc(s->ns, s->cap * sizeof(*s->ns));
+        if (!grown)
+            return -1;
+        s->ns = grown;
+    }
+    s->ns[s->nr++] = ns;
+    s->bytes += bytes;
+    return 0;
+}
+
+/**
+ * @brief Append the samples of a thread to the totals
+ *
+ * @param total the totals
+ * @param s the samples of the thread, freed
+ * @return int 0 if successful, -1 if out of memory
+ */
+static int samples_merge(struct samples *total, struct samples *s) {
+    uint64_t *grown;
+
+    grown = realloc(total->ns, (total->nr + s->nr + 1) * sizeof(*total->ns));
+    if (!grown)
+        return -1;
+    total->ns = grown;
+    memcpy(total->ns + total->nr, s->ns, s->nr * sizeof(*s->ns));
+    total->nr += s->nr;
+    total->bytes += s->bytes;
+    free(s->ns);
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Print the throughput and latency percentiles of an operation
+ *
+ * @param name the name of the operation
+ * @param s the samples, sorted in place
+ * @param elapsed the length of the run in nanoseconds
+ */
+static void samples_report(const char *name, struct samples *s,
+                           uint64_t elapsed) {
+    double secs = elapsed / 1e9;
+
+    if (s->nr == 0) {
+        printf("%-6s no operations\n", name);
+        return;
+    }
+    qsort(s->ns, s->nr, sizeof(*s->ns), cmp_u64);
+    printf("%-6s %10.0f ops/s %9.2f MiB/s  p50 %7.2f us  p99 %7.2f us"
+           "  p999 %7.2f us  max %8.2f us\n",
+           name, s->nr / secs, s->bytes / secs / (1 << 20),
+           s->ns[s->nr / 2] / 1e3, s->ns[s->nr * 99 / 100] / 1e3,
+           s->ns[s->nr * 999 / 1000] / 1e3, s->ns[s->nr - 1] / 1e3);
+}
+
+/**
+ * @brief Set up an io_uring with room for one submission
+ *
+ * liburing is not required: the rings are mapped by hand.
+ *
+ * @param r the ring
+ * @return int 0 if successful, -1 with errno set otherwise
+ */
+static int ring_init(struct ring *r) {
+    struct io_uring_params p;
+    void *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(SYS_io_uring_setup, 1, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    sq = r->sq = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    cq = r->cq = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED)
+        return -1;
+
+    r->sq_tail = (unsigned int *)((char *)sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)((char *)sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)((char *)sq + p.sq_off.array);
+    r->cq_head = (unsigned int *)((char *)cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)((char *)cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)((char *)cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Unmap and close a ring, also one that ring_init() left half set up
+ *
+ * @param r the ring
+ */
+static void ring_exit(struct ring *r) {
+    if (r->sq && r->sq != MAP_FAILED)
+        munmap(r->sq, r->sq_len);
+    if (r->cq && r->cq != MAP_FAILED)
+        munmap(r->cq, r->cq_len);
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->fd >= 0)
+        close(r->fd);
+}
+
+/**
+ * @brief Submit one vectored read or write and wait for it
+ *
+ * @param r the ring
+ * @param opcode IORING_OP_READV or IORING_OP_WRITEV
+ * @param fd the file
+ * @param iov the buffer
+ * @return long the result of the operation, or a negative errno
+ */
+static long ring_rw(struct ring *r, int opcode, int fd, struct iovec *iov) {
+    unsigned int tail = *r->sq_tail, head;
+    struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+    long res;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = 0;
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(SYS_io_uring_enter, r->fd, 1, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0) < 0)
+        return -errno;
+
+    head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return -EAGAIN;
+    res = r->cqes[head & *r->cq_mask].res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+/**
+ * @brief Read from the start of the buffer in the configured style
+ *
+ * @param w the worker
+ * @param fd the file, in the mode to read in
+ * @param buf the destination of read_size bytes
+ * @param map the mapping of the buffer, for STYLE_MMAP
+ * @param r the ring, for STYLE_URING
+ * @return long the bytes read, or -1 on error
+ */
+static long do_read(struct worker *w, int fd, char *buf, const char *map,
+                    struct ring *r) {
+    const struct config *cfg = w->cfg;
+    struct iovec iov[MAX_IOVS];
+    size_t part = cfg->read_size / cfg->iovs;
+    unsigned int i;
+    long ret;
+
+    switch (cfg->style) {
+    case STYLE_READV:
+        for (i = 0; i < cfg->iovs; i++) {
+            iov[i].iov_base = buf + i * part;
+            iov[i].iov_len = i + 1 < cfg->iovs ? part :
+                             cfg->read_size - i * part;
+        }
+        return preadv(fd, iov, cfg->iovs, 0);
+    case STYLE_MMAP:
+        /* the mapping shows the raw buffer, whatever the mode */
+        memcpy(buf, map, cfg->read_size);
+        return cfg->read_size;
+    case STYLE_URING:
+        iov[0].iov_base = buf;
+        iov[0].iov_len = cfg->read_size;
+        ret = ring_rw(r, IORING_OP_READV, fd, iov);
+        if (ret < 0) {
+            errno = -ret;
+            return -1;
+        }
+        return ret;
+    default:
+        return pread(fd, buf, cfg->read_size, 0);
+    }
+}
+
+/**
+ * @brief Overwrite the start of the buffer in the configured style
+ *
+ * mmap is read only, so writes in STYLE_MMAP use pwrite.
+ *
+ * @param w the worker
+ * @param fd the file
+ * @param buf the source of write_size bytes
+ * @param r the ring, for STYLE_URING
+ * @return long the bytes written, or -1 on error
+ */
+static long do_write(struct worker *w, int fd, char *buf, struct ring *r) {
+    const struct config *cfg = w->cfg;
+    struct iovec iov[MAX_IOVS];
+    size_t part = cfg->write_size / cfg->iovs;
+    unsigned int i;
+    long ret;
+
+    switch (cfg->style) {
+    case STYLE_READV:
+        for (i = 0; i < cfg->iovs; i++) {
+            iov[i].iov_base = buf + i * part;
+            iov[i].iov_len = i + 1 < cfg->iovs ? part :
+                             cfg->write_size - i * part;
+        }
+        return pwritev(fd, iov, cfg->iovs, 0);
+    case STYLE_URING:
+        iov[0].iov_base = buf;
+        iov[0].iov_len = cfg->write_size;
+        ret = ring_rw(r, IORING_OP_WRITEV, fd, iov);
+        if (ret < 0) {
+            errno = -ret;
+            return -1;
+        }
+        return ret;
+    default:
+        return pwrite(fd, buf, cfg->write_size, 0);
+    }
+}
+
+/**
+ * @brief Thread body: alternate writes and reads until the run ends
+ *
+ * @param arg the worker
+ * @return void* NULL
+ */
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    const struct config *cfg = w->cfg;
+    int fds[MAX_MODES] = { -1, -1, -1 };
+    char *wbuf = NULL, *rbuf = NULL, *map = MAP_FAILED;
+    size_t map_len = cfg->read_size;
+    struct ring r = { .fd = -1 };
+    unsigned long op, reads = 0;
+    unsigned int i;
+    uint64_t start;
+    long ret;
+
+    wbuf = malloc(cfg->write_size);
+    rbuf = malloc(cfg->read_size);
+    if (!wbuf || !rbuf)
+        goto fail;
+    for (i = 0; i < cfg->write_size; i++)
+        wbuf[i] = 'a' + i % 26;
+
+    for (i = 0; i < cfg->nr_modes; i++) {
+        fds[i] = open(cfg->device, O_RDWR);
+        if (fds[i] < 0 ||
+            ioctl(fds[i], HEARTYDEV_SET_MODE, &cfg->modes[i]) < 0)
+            goto fail;
+    }
+    if (cfg->style == STYLE_MMAP) {
+        map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fds[0], 0);
+        if (map == MAP_FAILED)
+            goto fail;
+    }
+    if (cfg->style == STYLE_URING && ring_init(&r) < 0)
+        goto fail;
+
+    for (op = 0; !stop; op++) {
+        if (op % (cfg->reads_per_write + 1) == 0) {
+            if (cfg->write_size == 0)
+                continue;
+            start = now_ns();
+            ret = do_write(w, fds[0], wbuf, &r);
+            if (ret < 0 || samples_add(&w->writes, now_ns() - start, ret))
+                goto fail;
+        } else {
+            /* its own counter, so every mode gets its share of reads */
+            i = reads++ % cfg->nr_modes;
+            start = now_ns();
+            ret = do_read(w, fds[i], rbuf, map, &r);
+            if (ret < 0 || samples_add(&w->reads, now_ns() - start, ret))
+                goto fail;
+        }
+    }
+    goto out;
+
+fail:
+    w->error = errno ? errno : ENOMEM;
+out:
+    if (map != MAP_FAILED)
+        munmap(map, map_len);
+    ring_exit(&r);
+    for (i = 0; i < cfg->nr_modes; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    free(wbuf);
+    free(rbuf);
+    return NULL;
+}
+
+/**
+ * @brief Parse a comma separated list of modes
+ *
+ * @param cfg the configuration to fill in
+ * @param list the list, e.g. "normal,upper"
+ * @return int 0 if successful, -1 for an unknown or extra mode
+ */
+static int parse_modes(struct config *cfg, char *list) {
+    char *name, *save = NULL;
+    int mode;
+
+    cfg->nr_modes = 0;
+    for (name = strtok_r(list, ",", &save); name;
+         name = strtok_r(NULL, ",", &save)) {
+        for (mode = 0; mode < MAX_MODES; mode++)
+            if (strcmp(name, mode_names[mode]) == 0)
+                break;
+        if (mode == MAX_MODES || cfg->nr_modes == MAX_MODES)
+            return -1;
+        cfg->modes[cfg->nr_modes++] = mode;
+    }
+    return cfg->nr_modes ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d device] [-w write_size] [-r read_size]\n"
+            "          [-R reads_per_write] [-t threads] [-T seconds]\n"
+            "          [-s rw|readv|mmap|uring] [-v iovecs]\n"
+            "          [-m normal,upper,lower]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct config cfg = {
+        .device = DEFAULT_DEVICE,
+        .write_size = 4096,
+        .read_size = 4096,
+        .reads_per_write = 4,
+        .threads = 1,
+        .seconds = 5,
+        .iovs = 4,
+        .style = STYLE_RW,
+        .modes = { HEARTYDEV_NORMAL },
+        .nr_modes = 1,
+    };
+    struct samples reads = { 0 }, writes = { 0 };
+    struct worker *workers;
+    char *prefill;
+    uint64_t start, elapsed;
+    unsigned int i;
+    int opt, fd, failed = 0;
+
+    while ((opt = getopt(argc, argv, "d:w:r:R:t:T:s:v:m:h")) != -1) {
+        switch (opt) {
+        case 'd': cfg.device = optarg; break;
+        case 'w': cfg.write_size = strtoul(optarg, NULL, 0); break;
+        case 'r': cfg.read_size = strtoul(optarg, NULL, 0); break;
+        case 'R': cfg.reads_per_write = strtoul(optarg, NULL, 0); break;
+        case 't': cfg.threads = strtoul(optarg, NULL, 0); break;
+        case 'T': cfg.seconds = strtoul(optarg, NULL, 0); break;
+        case 'v': cfg.iovs = strtoul(optarg, NULL, 0); break;
+        case 's':
+            for (i = 0; i < 4; i++)
+                if (strcmp(optarg, style_names[i]) == 0)
+                    break;
+            if (i == 4) {
+                usage(argv[0]);
+                return 1;
+            }
+            cfg.style = i;
+            break;
+        case 'm':
+            if (parse_modes(&cfg, optarg) == 0)
+                break;
+            /* fall through */
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    /* without reads and without writes a worker would only spin */
+    if (cfg.read_size == 0 || cfg.threads == 0 || cfg.iovs == 0 ||
+        cfg.iovs > MAX_IOVS ||
+        (cfg.reads_per_write == 0 && cfg.write_size == 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* make sure every read finds read_size bytes, and mmap has pages */
+    fd = open(cfg.device, O_WRONLY | O_TRUNC);
+    prefill = calloc(1, cfg.read_size);
+    if (fd < 0 || !prefill ||
+        pwrite(fd, prefill, cfg.read_size, 0) != (ssize_t)cfg.read_size) {
+        perror(cfg.device);
+        return 1;
+    }
+    close(fd);
+    free(prefill);
+
+    workers = calloc(cfg.threads, sizeof(*workers));
+    if (!workers)
+        return 1;
+    start = now_ns();
+    for (i = 0; i < cfg.threads; i++) {
+        workers[i].cfg = &cfg;
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    sleep(cfg.seconds);
+    stop = 1;
+    for (i = 0; i < cfg.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    elapsed = now_ns() - start;
+
+    for (i = 0; i < cfg.threads; i++) {
+        if (workers[i].error) {
+            fprintf(stderr, "thread %u: %s\n", i, strerror(workers[i].error));
+            failed = 1;
+        }
+        if (samples_merge(&reads, &workers[i].reads) ||
+            samples_merge(&writes, &workers[i].writes))
+            return 1;
+    }
+
+    printf("%s: %u threads, %s, write %zu B, read %zu B, %u reads per write,"
+           " modes", cfg.device, cfg.threads, style_names[cfg.style],
+           cfg.write_size, cfg.read_size, cfg.reads_per_write);
+    for (i = 0; i < cfg.nr_modes; i++)
+        printf("%c%s", i ? ',' : ' ', mode_names[cfg.modes[i]]);
+    printf("\n");
+    samples_report("read", &reads, elapsed);
+    samples_report("write", &writes, elapsed);
+
+    free(reads.ns);
+    free(writes.ns);
+    free(workers);
+    return failed;
+}
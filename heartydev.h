@@ -0,0 +1,168 @@
+/**
+ * @file heartydev.h
+ * @brief User space interface of the heartydev character device driver.
+ *
+ * This header is shared by the driver and by applications that issue
+ * heartydev ioctls, so it only depends on the user space visible kernel
+ * headers.
+ */
+
+#ifndef HEARTYDEV_H
+#define HEARTYDEV_H
+
+#include <linux/ioctl.h>    // for _IOW, _IOR, _IOWR
+#include <linux/types.h>    // for __u64
+
+#define MAJOR_NUM 100
+
+/* define the IOCTL's message of the device driver */
+#define HEARTYDEV_WRITE_CNT _IOW(MAJOR_NUM, 0, char *)
+#define HEARTYDEV_READ_CNT _IOR(MAJOR_NUM, 1, char *)
+#define HEARTYDEV_BUF_LEN _IOWR(MAJOR_NUM, 2, int)
+
+/* define the IOCTL's mode of the device driver */
+#define HEARTYDEV_SET_MODE _IOW(MAJOR_NUM, 3, int)
+#define HEARTYDEV_NORMAL 0
+#define HEARTYDEV_UPPER 1
+#define HEARTYDEV_LOWER 2
+#define HEARTYDEV_ROT13 3   /* rotate letters by 13 places */
+#define HEARTYDEV_LUT 4     /* map bytes through the table of HEARTYDEV_SET_LUT */
+#define HEARTYDEV_FOLD 5    /* fold Latin-1 to ASCII */
+#define HEARTYDEV_HEX 6     /* two lowercase hex digits per byte, read only */
+#define HEARTYDEV_MAX_MODES 8
+
+/*
+ * define the IOCTL's store of the device driver. Like HEARTYDEV_RENDER and
+ * HEARTYDEV_SET_POLICY it needs a file open for writing, or fails with
+ * EBADF.
+ */
+#define HEARTYDEV_SET_STORE _IOW(MAJOR_NUM, 4, int)
+#define HEARTYDEV_STORE_BUFFER 0
+#define HEARTYDEV_STORE_RING 1
+
+/*
+ * HEARTYDEV_RENDER transforms the message buffer once with the current mode.
+ * mmap() at offset 0 maps the raw message buffer read-only, and at offset
+ * HEARTYDEV_MMAP_RENDERED it maps the rendered copy. A module loaded with
+ * compress cannot map the message buffer, only the rendered copy.
+ */
+#define HEARTYDEV_RENDER _IO(MAJOR_NUM, 5)
+#define HEARTYDEV_MMAP_RENDERED 0x80000000UL
+
+/*
+ * Snapshot returned by HEARTYDEV_GET_STATS. The counters cover the whole
+ * device since the module was loaded; transform_bytes counts the bytes
+ * read in each mode. With compress, compressed_pages pages of the message
+ * buffer are currently held in compressed_bytes bytes, so the achieved
+ * ratio is compressed_pages * page size / compressed_bytes.
+ */
+struct heartydev_stats {
+    __u64 reads;
+    __u64 writes;
+    __u64 bytes_in;
+    __u64 bytes_out;
+    __u64 transform_bytes[HEARTYDEV_MAX_MODES];
+    __u64 errors;
+    __u64 buf_len;
+    __u64 compressed_pages;
+    __u64 compressed_bytes;
+};
+
+#define HEARTYDEV_GET_STATS _IOR(MAJOR_NUM, 6, struct heartydev_stats)
+
+/*
+ * HEARTYDEV_BATCH runs an array of operations in order under one lock. The
+ * ioctl returns how many succeeded; the batch stops at the first failure.
+ * result receives the bytes moved by a read or write, 0 for the other
+ * operations, or a negative error code. Reads and writes use offset as
+ * the position, like pread() and pwrite(), and SET_MODE takes the mode in
+ * len. GET_STATS fills the struct heartydev_stats at addr.
+ */
+#define HEARTYDEV_OP_WRITE 0
+#define HEARTYDEV_OP_SET_MODE 1
+#define HEARTYDEV_OP_READ 2
+#define HEARTYDEV_OP_GET_STATS 3
+
+struct heartydev_op {
+    __u32 opcode;
+    __u32 flags;    /* must be 0 */
+    __u64 addr;     /* user buffer */
+    __u64 len;      /* size of the buffer, or the mode */
+    __s64 offset;   /* position of a read or write */
+    __s64 result;   /* filled in by the driver */
+};
+
+struct heartydev_batch {
+    __u64 ops;      /* pointer to an array of struct heartydev_op */
+    __u32 nr;       /* number of entries, at most 256 */
+    __u32 flags;    /* must be 0 */
+};
+
+#define HEARTYDEV_BATCH _IOWR(MAJOR_NUM, 7, struct heartydev_batch)
+
+/*
+ * Payload of an IORING_OP_URING_CMD, which fits the 16 bytes of a regular
+ * SQE. The cmd_op of the SQE is one of
+ *   HEARTYDEV_SET_MODE   arg is the mode
+ *   HEARTYDEV_GET_STATS  addr points to a struct heartydev_stats
+ *   HEARTYDEV_URING_READ reads up to len bytes into addr, at offset arg in
+ *                        the message buffer; the result is the byte count
+ */
+struct heartydev_uring_cmd {
+    __u64 addr;
+    __u32 len;
+    __u32 arg;
+};
+
+#define HEARTYDEV_URING_READ _IOR(MAJOR_NUM, 8, struct heartydev_uring_cmd)
+
+/*
+ * HEARTYDEV_SET_LUT sets the table that HEARTYDEV_LUT maps bytes through.
+ * The table belongs to the open file and starts out as the identity.
+ */
+struct heartydev_lut {
+    __u8 map[256];
+};
+
+#define HEARTYDEV_SET_LUT _IOW(MAJOR_NUM, 9, struct heartydev_lut)
+
+/*
+ * HEARTYDEV_SET_POLICY chooses when the device applies a mode. With
+ * HEARTYDEV_POLICY_ON_READ (the default) every read applies the mode of
+ * its file. With HEARTYDEV_POLICY_ON_WRITE, later writes from any file are
+ * stored transformed by mode, and reads return the stored bytes. A
+ * HEARTYDEV_LUT mode uses the table of the file that set the policy. Modes
+ * that change the length, such as HEARTYDEV_HEX, cannot be used on write.
+ */
+#define HEARTYDEV_POLICY_ON_READ 0
+#define HEARTYDEV_POLICY_ON_WRITE 1
+
+struct heartydev_policy {
+    __u32 policy;
+    __u32 mode;
+};
+
+#define HEARTYDEV_SET_POLICY _IOW(MAJOR_NUM, 10, struct heartydev_policy)
+
+/*
+ * HEARTYDEV_SET_ASYNC takes a pointer to an int that turns asynchronous
+ * writes on (nonzero) or off (0) for the open file. While they are on,
+ * writes of the message buffer of at least async_threshold bytes return as
+ * soon as they are queued and are stored later, in the order they were
+ * issued. Files start with them off. HEARTYDEV_WRITE_BARRIER waits until
+ * the queued writes of the file are stored and returns the first error one
+ * of them hit since the last barrier, or 0. HEARTYDEV_SET_EVENTFD takes a
+ * pointer to an eventfd descriptor that is signalled once per stored
+ * write, or to -1 to stop.
+ *
+ * The pages of the user buffer are pinned when write() returns, not
+ * copied, and the data is only read from them later. The buffer must stay
+ * unmodified until HEARTYDEV_WRITE_BARRIER returns. An O_APPEND write goes
+ * to the end of the buffer as it is when the write is stored, and leaves
+ * the file position alone.
+ */
+#define HEARTYDEV_WRITE_BARRIER _IO(MAJOR_NUM, 11)
+#define HEARTYDEV_SET_EVENTFD _IOW(MAJOR_NUM, 12, int)
+#define HEARTYDEV_SET_ASYNC _IOW(MAJOR_NUM, 13, int)
+
+#endif /* HEARTYDEV_H */
@@ -0,0 +1,84 @@
+/**
+ * @file heartydev_trace.h
+ * @brief Tracepoints of the heartydev character device driver.
+ *
+ * The events are compiled in but cost a single patched branch while they
+ * are disabled. Enable them with perf or through tracefs, e.g.
+ * echo 1 > /sys/kernel/tracing/events/heartydev/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM heartydev
+
+#if !defined(HEARTYDEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define HEARTYDEV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(heartydev_io,
+
+    TP_PROTO(loff_t pos, size_t count, ssize_t ret, int mode, u64 latency_ns),
+
+    TP_ARGS(pos, count, ret, mode, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+        __field(int, mode)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+        __entry->mode = mode;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("pos=%lld count=%zu ret=%zd mode=%d latency=%lluns",
+              __entry->pos, __entry->count, __entry->ret, __entry->mode,
+              __entry->latency_ns)
+);
+
+DEFINE_EVENT(heartydev_io, heartydev_read,
+    TP_PROTO(loff_t pos, size_t count, ssize_t ret, int mode, u64 latency_ns),
+    TP_ARGS(pos, count, ret, mode, latency_ns)
+);
+
+DEFINE_EVENT(heartydev_io, heartydev_write,
+    TP_PROTO(loff_t pos, size_t count, ssize_t ret, int mode, u64 latency_ns),
+    TP_ARGS(pos, count, ret, mode, latency_ns)
+);
+
+TRACE_EVENT(heartydev_ioctl,
+
+    TP_PROTO(unsigned int cmd, long ret, u64 latency_ns),
+
+    TP_ARGS(cmd, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(long, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("cmd=%#x nr=%u ret=%ld latency=%lluns", __entry->cmd,
+              _IOC_NR(__entry->cmd), __entry->ret, __entry->latency_ns)
+);
+
+#endif /* HEARTYDEV_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE heartydev_trace
+#include <trace/define_trace.h>
@@ -24,62 +24,407 @@
 #include <linux/ioctl.h>    // for _IOW, _IOR, _IOWR
 #include <linux/string.h>   // for strnlen_user
 #include <linux/slab.h>     // for kmalloc and kfree
+#include <linux/mm.h>       // for alloc_page and kvmalloc
+#include <linux/mutex.h>    // for DEFINE_MUTEX
+#include <linux/moduleparam.h> // for module_param
+#include <linux/vmalloc.h>  // for vmalloc and vfree
+#include <linux/wait.h>     // for wait_event_interruptible
+#include <linux/log2.h>     // for roundup_pow_of_two
+#include <linux/poll.h>     // for poll_wait
+#include <linux/rcupdate.h> // for rcu_assign_pointer
+#include <linux/srcu.h>     // for DEFINE_STATIC_SRCU
+#include <linux/rwsem.h>    // for DECLARE_RWSEM
+#include <linux/overflow.h> // for struct_size
+#include <linux/percpu.h>   // for DEFINE_PER_CPU
+#include <linux/ktime.h>    // for ktime_get_ns
+#include <linux/uio.h>      // for struct iov_iter
+#include <linux/splice.h>   // for splice_to_pipe
+#include <linux/pipe_fs_i.h> // for struct pipe_buf_operations
+#include <linux/mempool.h>  // for mempool_create_page_pool
+#include <linux/highmem.h>  // for clear_highpage
+#include <linux/topology.h> // for numa_node_id
+#include <linux/debugfs.h>  // for debugfs_create_file
+#include <linux/seq_file.h> // for seq_printf
+#include <linux/jump_label.h> // for DEFINE_STATIC_KEY_FALSE
+#include <linux/lz4.h>      // for LZ4_compress_default
+#include <linux/workqueue.h> // for alloc_workqueue
+#include <linux/eventfd.h>  // for eventfd_signal
+#include <linux/bvec.h>     // for struct bio_vec
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h> // for struct io_uring_cmd
+#endif
+
+#include "heartydev.h"
+#include "transform.h"
+
+#define CREATE_TRACE_POINTS
+#include "heartydev_trace.h"
 
 /* Define the necessary constants */
-#define MAJOR_NUM 100 
 #define MESSAGE_MAX_LEN 256
-#define DEBUG_PRINT(fmt, args...) \
-    printk(KERN_DEBUG "heartydev [%lld]: " fmt, ktime_get_real_ns(), ##args)
+#define MESSAGE_DEFAULT_MAX_SIZE (16UL * 1024 * 1024)
+#define RING_DEFAULT_SIZE (64UL * 1024)
+#define SCRATCH_SIZE PAGE_SIZE
+#define HEARTYDEV_BATCH_MAX 256
+#define HEARTYDEV_MAX_DEVS 64
+#define HIST_BUCKETS 32
+#define ZPAGE_MAX (PAGE_SIZE - PAGE_SIZE / 8)
+#define ASYNC_CHUNK (256UL * 1024)
+#define PARALLEL_CHUNK (256UL * 1024)
 
-/* define the IOCTL's message of the device driver */
-#define HEARTYDEV_WRITE_CNT _IOW(MAJOR_NUM, 0, char *) 
-#define HEARTYDEV_READ_CNT _IOR(MAJOR_NUM, 1, char *) 
-#define HEARTYDEV_BUF_LEN _IOWR(MAJOR_NUM, 2, int) 
+/* states of the claim a file holds on its device */
+enum {
+    CDEV_NOT_USED = 0,
+    CDEV_EXCLUSIVE_OPEN = 1,
+};
 
-/* define the IOCTL's mode of the device driver */
-#define HEARTYDEV_SET_MODE _IOW(MAJOR_NUM, 3, int)
-#define HEARTYDEV_NORMAL 0
-#define HEARTYDEV_UPPER 1
-#define HEARTYDEV_LOWER 2
-
-enum { 
-    CDEV_NOT_USED = 0, 
-    CDEV_EXCLUSIVE_OPEN = 1, 
-}; 
+/* values of open_policy */
+enum {
+    OPEN_SHARED = 0,        /* any number of readers and writers */
+    OPEN_EXCLUSIVE = 1,     /* a single open file */
+    OPEN_SINGLE_WRITER = 2, /* one writer, any number of readers */
+};
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("A simple character device driver");
 MODULE_AUTHOR("pkongkae@cmkl.ac.th>");
 
+/* upper bound of the backing store, in bytes */
+static unsigned long max_buffer_size = MESSAGE_DEFAULT_MAX_SIZE;
+module_param(max_buffer_size, ulong, 0444);
+MODULE_PARM_DESC(max_buffer_size, "Maximum size of the message buffer in bytes");
+
+/* size of the ring used by HEARTYDEV_STORE_RING, rounded up to a power of two */
+static unsigned long ring_size = RING_DEFAULT_SIZE;
+module_param(ring_size, ulong, 0444);
+MODULE_PARM_DESC(ring_size, "Size of the FIFO ring buffer in bytes");
+
+/* number of minors, each with its own buffer */
+static unsigned int nr_devs = 1;
+module_param(nr_devs, uint, 0444);
+MODULE_PARM_DESC(nr_devs, "Number of /dev/heartydevN devices to create");
+
+/* cache transformed pages so repeated reads in one mode are plain copies */
+static bool cache_views = true;
+module_param(cache_views, bool, 0644);
+MODULE_PARM_DESC(cache_views, "Cache the transformed views of the message buffer");
+
+/* mode a newly opened file starts in, until it issues HEARTYDEV_SET_MODE */
+static int default_mode = HEARTYDEV_UPPER;
+module_param(default_mode, int, 0644);
+MODULE_PARM_DESC(default_mode, "Mode of newly opened files (0 normal, 1 upper, 2 lower, 3 rot13, 4 lut, 5 fold, 6 hex)");
+
+/* who may open a minor at the same time, fixed at load time */
+static int open_policy = OPEN_SHARED;
+module_param(open_policy, int, 0444);
+MODULE_PARM_DESC(open_policy, "Admission of opens (0 shared, 1 exclusive, 2 single writer with many readers)");
+
+/* let readers on other nodes copy the buffer pages they read to local memory */
+static bool numa_replicas = false;
+module_param(numa_replicas, bool, 0644);
+MODULE_PARM_DESC(numa_replicas, "Keep per-node copies of the message buffer for readers");
+
+/* pages held in reserve for the message buffer, allocated at load time */
+static unsigned int pool_pages = 256;
+module_param(pool_pages, uint, 0444);
+MODULE_PARM_DESC(pool_pages, "Number of pages preallocated for the message buffers");
+
+/* keep full pages of the message buffer LZ4-compressed */
+static bool compress = false;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Store full pages of the message buffer compressed with LZ4");
+
+/* writes of at least this many bytes return early, in files that ask for it */
+static unsigned long async_threshold = ASYNC_CHUNK;
+module_param(async_threshold, ulong, 0644);
+MODULE_PARM_DESC(async_threshold, "Size from which writes of files with HEARTYDEV_SET_ASYNC are stored asynchronously");
+
+/* asynchronous writes a device may have in flight */
+static unsigned int async_depth = 16;
+module_param(async_depth, uint, 0644);
+MODULE_PARM_DESC(async_depth, "Maximum number of asynchronous writes in flight per device");
+
+/* reads of at least this many bytes are transformed on several CPUs */
+static unsigned long parallel_threshold = 1024 * 1024;
+module_param(parallel_threshold, ulong, 0644);
+MODULE_PARM_DESC(parallel_threshold, "Size from which a read is transformed on several CPUs (0 never)");
+
+/* CPUs one such read is spread over, at most */
+static unsigned int parallel_fanout = 8;
+module_param(parallel_fanout, uint, 0644);
+MODULE_PARM_DESC(parallel_fanout, "Maximum number of CPUs that transform one read");
+
 static int heartydev_open(struct inode *inode, struct file *file);
 static int heartydev_release(struct inode *inode, struct file *file);
 static long heartydev_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
-static ssize_t heartydev_read(struct file *file, char __user *buf, size_t count, loff_t *offset);
-static ssize_t heartydev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset);
+static ssize_t heartydev_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t heartydev_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t heartydev_splice_read(struct file *in, loff_t *ppos,
+                                     struct pipe_inode_info *pipe, size_t len,
+                                     unsigned int flags);
+static __poll_t heartydev_poll(struct file *file, poll_table *wait);
+static loff_t heartydev_llseek(struct file *file, loff_t offset, int whence);
+static long heartydev_batch(struct file *file, unsigned long arg);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+static int heartydev_uring_cmd(struct io_uring_cmd *ioucmd,
+                               unsigned int issue_flags);
+#endif
+static int heartydev_mmap(struct file *file, struct vm_area_struct *vma);
 
 /* Define the file operations */
 static const struct file_operations heartydev_fops = {
+    .owner = THIS_MODULE,
+    .llseek = heartydev_llseek,
     .open = heartydev_open,
     .release = heartydev_release,
     .unlocked_ioctl = heartydev_ioctl,
-    .read = heartydev_read,
-    .write = heartydev_write};
+    .read_iter = heartydev_read_iter,
+    .write_iter = heartydev_write_iter,
+    .splice_read = heartydev_splice_read,
+    .splice_write = iter_file_splice_write,
+    .poll = heartydev_poll,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    .uring_cmd = heartydev_uring_cmd,
+#endif
+    .mmap = heartydev_mmap};
+
+/* operations with a latency histogram */
+enum {
+    HIST_READ,
+    HIST_WRITE,
+    HIST_IOCTL,
+    HIST_OPS,
+};
+
+/*
+ * log2 latency histogram: bucket 0 counts 0 ns, bucket i > 0 counts
+ * [2^(i - 1), 2^i) ns, and the last bucket everything above
+ */
+struct heartydev_hist {
+    u64 buckets[HIST_BUCKETS];
+};
+
+/*
+ * functions time called and bytes moved. Each CPU bumps its own copy so the
+ * hot paths never share a cache line; the copies are summed on demand.
+ */
+struct heartydev_pcpu_stats {
+    u64 reads;
+    u64 writes;
+    u64 bytes_in;
+    u64 bytes_out;
+    u64 transform_bytes[HEARTYDEV_MAX_MODES];
+    u64 errors;
+    struct heartydev_hist latency[HIST_OPS];
+};
+
+/* latency histograms are only kept while enabled through debugfs */
+static DEFINE_STATIC_KEY_FALSE(latency_key);
+
+/* time spent in the transform step, over all devices */
+static DEFINE_PER_CPU(struct heartydev_hist, transform_hist);
+
+/*
+ * One published version of a page set. A version never changes once it is
+ * published, apart from bytes at or past len, which no reader looks at, so
+ * appends can fill the last page in place. Every other write builds the
+ * next version under message_lock, copying only the pages it touches, and
+ * swaps it in. Readers hold message_srcu instead of a lock and see one
+ * consistent version for the whole call, even if they sleep in
+ * copy_to_user(). nr_pages is always DIV_ROUND_UP(len, PAGE_SIZE).
+ *
+ * Because a version is immutable it also serves as the generation of its
+ * views: views[mode] caches the bytes transformed with mode, filled one
+ * page at a time by the first reader that needs it. A write publishes a
+ * new version that keeps only the view pages of pages it did not copy,
+ * and the old views are freed with the old version.
+ *
+ * With compress, the message buffer keeps each full page either as a page
+ * or, if LZ4 shrinks it enough, as a heartydev_zpage in zpages, where the
+ * entry in pages is NULL. Pages are only compressed once they are full,
+ * so appends never have to unpack one.
+ */
+struct heartydev_store {
+    struct rcu_head rcu;
+    size_t len;              /* bytes of valid data */
+    size_t nr_pages;         /* entries in pages */
+    size_t nr_retired;       /* entries in retired */
+    struct page **retired;   /* pages the next version dropped */
+    struct page **views[HEARTYDEV_MAX_MODES]; /* nr_pages entries each */
+    struct page ***replicas; /* nr_node_ids copies of pages, or NULL */
+    struct heartydev_zpage **zpages; /* nr_pages entries, or NULL */
+    size_t nr_zpages;        /* compressed pages */
+    size_t zbytes;           /* bytes of compressed data */
+    size_t nr_zretired;      /* entries in zretired */
+    struct heartydev_zpage **zretired; /* zpages the next version dropped */
+    struct page *pages[];
+};
+
+/* one compressed page of the message buffer */
+struct heartydev_zpage {
+    unsigned int len;        /* bytes in data */
+    char data[];
+};
+
+/*
+ * One minor. Every minor has its own message buffer, ring and counters, so
+ * load can be sharded across devices without any shared lock.
+ *
+ * message is bounded by max_buffer_size. rendered holds the output of
+ * HEARTYDEV_RENDER and is only replaced by that ioctl. Page faults on
+ * mappings take map_sem for reading, and publishing a version takes it for
+ * writing, so no fault can map a page of a version that just went away.
+ *
+ * ring_head and ring_tail run freely and are reduced modulo ring_size on
+ * access, so head - tail is always the number of queued bytes.
+ *
+ * With HEARTYDEV_POLICY_ON_WRITE, writes to either store apply write_mode
+ * (and write_lut) while copying, and reads return the stored bytes as
+ * they are. The policy is changed with both message_lock and ring_lock
+ * held, so each writer sees it stable under its own lock.
+ *
+ * in_use is CDEV_EXCLUSIVE_OPEN while a file holds the claim that
+ * open_policy hands out: every file under OPEN_EXCLUSIVE, writers under
+ * OPEN_SINGLE_WRITER.
+ */
+struct heartydev_device {
+    struct cdev cdev;
+    struct device *device;
+    dev_t devt;
+
+    struct heartydev_store __rcu *message;
+    struct heartydev_store __rcu *rendered;
+    struct mutex message_lock;
+    struct rw_semaphore map_sem;
+    struct address_space *mapping;
+
+    int current_store;
+    char *ring_data;
+    size_t ring_head;
+    size_t ring_tail;
+    struct mutex ring_lock;
+
+    int policy;
+    int write_mode;
+    u8 write_lut[256];
+
+    /* readers and pollers waiting for data, writers waiting for room */
+    wait_queue_head_t readq;
+    wait_queue_head_t writeq;
+
+    struct heartydev_pcpu_stats __percpu *stats;
+
+    atomic_t in_use;
+    int mode;       /* mode of new files, set in sysfs, or -1 for default_mode */
+
+    /* LZ4 state of writers under message_lock, with compress */
+    void *zwork;
+    char *zbounce;
+
+    /* asynchronous writes, in submission order, under async_lock */
+    struct workqueue_struct *async_wq;
+    spinlock_t async_lock;
+    struct list_head async_list;
+    size_t async_end;           /* where the queued writes should end */
+    atomic_t async_inflight;
+    wait_queue_head_t asyncq;   /* barriers waiting for their writes */
+};
+
+/*
+ * per-open state, kept in file->private_data. The mode only affects reads
+ * through this file; the file position already lives in struct file.
+ */
+struct heartydev_file {
+    struct heartydev_device *dev;
+    int mode;
+    struct mutex read_lock;     /* held while scratch or zbuf is in use */
+    char *scratch;  /* SCRATCH_SIZE bytes for transforming reads */
+    char *zbuf;     /* a page to decompress reads into, with compress */
+    bool claimed;   /* holds the in_use claim of the device */
+    u8 lut[256];    /* table of HEARTYDEV_LUT, set by HEARTYDEV_SET_LUT */
+    bool async;                 /* HEARTYDEV_SET_ASYNC turned writes async */
+    atomic_t async_inflight;    /* asynchronous writes not yet stored */
+    int async_err;              /* first error of one, until the barrier */
+    struct eventfd_ctx *efd;    /* signalled per stored write, or NULL */
+};
+
+/*
+ * An asynchronous write of the message buffer. The user pages are pinned
+ * when the write is issued, and each ASYNC_CHUNK of the write is copied,
+ * with the write mode of the device at that time, into fresh buffer pages
+ * by its own work item on the unbound async_wq of the device, so the
+ * chunks of a large write are copied on several CPUs. The data starts at
+ * soff in the first of these spages, where it falls within a page of the
+ * buffer if the write lands where it is expected to. Once the last chunk
+ * is done the write is stored, in the order the writes were issued, and
+ * storing it only puts the spages into the next version. A write that
+ * lands at another offset within a page, because another write got in
+ * between, is copied out of them instead. The request holds a reference to
+ * the file until then.
+ */
+struct heartydev_async_chunk {
+    struct work_struct work;
+    struct heartydev_async *req;
+    size_t start;               /* offset within the write */
+    size_t len;
+};
+
+struct heartydev_async {
+    struct list_head node;      /* in async_list of the device */
+    struct file *file;
+    loff_t pos;
+    bool append;
+    bool staged;                /* copied into spages, under async_lock */
+    size_t len;
+    size_t offset;              /* of the data in the first pinned page */
+    struct page **pages;
+    unsigned int nr_pages;
+    size_t soff;                /* of the data in the first staged page */
+    struct page **spages;       /* the staged copy, NULL where stored */
+    unsigned int nr_spages;
+    int err;                    /* of a chunk that could not be staged */
+    int mode;
+    u8 lut[256];
+    atomic_t pending;           /* chunks still being copied */
+    unsigned int nr_chunks;
+    struct heartydev_async_chunk chunks[];
+};
+
+/*
+ * A large read transformed in parallel. Each chunk covers whole pages of
+ * the buffer and runs as a work item on system_unbound_wq, except the
+ * first, which the reader runs itself. The chunks either fill the pages
+ * of the cached view, or write to out, where they start on page
+ * multiples of the output and so never share a cache line.
+ */
+struct heartydev_par_chunk {
+    struct work_struct work;
+    struct heartydev_par *par;
+    size_t start;               /* source bytes of the chunk */
+    size_t end;
+    char *zbuf;                 /* a page to unpack into, with compress */
+};
+
+struct heartydev_par {
+    struct heartydev_store *st;
+    int mode;
+    const u8 *table;
+    char *out;                  /* the output, or NULL to fill the view */
+    size_t base;                /* source offset whose output is out[0] */
+    unsigned int nr_chunks;
+    struct heartydev_par_chunk chunks[];
+};
 
 /* Define the global variables */
-dev_t dev = 0;
+static dev_t heartydev_devt = 0;
 static struct class *heartydev_class = NULL;
-static struct cdev heartydev_cdev;
-
-/* functions time called */
-static int read_count = 0;
-static int write_count = 0;
-static int current_mode = HEARTYDEV_UPPER;
+static struct heartydev_device *heartydev_devs = NULL;
+static struct kmem_cache *heartydev_file_cache = NULL;
+static struct dentry *heartydev_debugfs = NULL;
+static mempool_t *heartydev_page_pool = NULL;
 
-/* message buffer */
-static char *message = NULL;
-static size_t message_capacity = 0;
-static int message_len = 0;
-static atomic_t already_open = ATOMIC_INIT(CDEV_NOT_USED); 
+/* one SRCU domain protects the versions of every minor */
+DEFINE_STATIC_SRCU(message_srcu);
 
 /** 
  * @brief uevent function for the device class
@@ -93,226 +438,3293 @@ static int heartydev_uevent(struct device *dev, struct kobj_uevent_env *env) {
     return 0;
 }
 
-/** 
- * @brief Initialize the device driver
- * 
- * @return int 0 if successful
+/**
+ * @brief Account for a successful read
+ *
+ * @param hd the device
+ * @param mode the mode the bytes were read in
+ * @param bytes the number of bytes read
  */
-static int __init heartydev_init(void) {
-    printk(KERN_INFO "----heartydev INIT START----\n");
-    if (alloc_chrdev_region(&dev, 0, 1, "heartydev") < 0) {
-        printk(KERN_ALERT "heartydev registration failed\n");
-        return -1;
-    }
+static void stats_read(struct heartydev_device *hd, int mode, size_t bytes) {
+    this_cpu_inc(hd->stats->reads);
+    this_cpu_add(hd->stats->bytes_out, bytes);
+    this_cpu_add(hd->stats->transform_bytes[mode], bytes);
+}
 
-    /* allocate memory for the buffer */
-    message = kmalloc(MESSAGE_MAX_LEN, GFP_KERNEL);
-    if (!message) {
-        printk(KERN_ALERT "Failed to allocate initial message buffer\n");
-        unregister_chrdev_region(dev, 1);
-        return -ENOMEM;
+/**
+ * @brief Account for a successful write
+ *
+ * @param hd the device
+ * @param bytes the number of bytes written
+ */
+static void stats_write(struct heartydev_device *hd, size_t bytes) {
+    this_cpu_inc(hd->stats->writes);
+    this_cpu_add(hd->stats->bytes_in, bytes);
+}
+
+/**
+ * @brief Account for a failed read or write
+ *
+ * @param hd the device
+ * @param err the error code being returned
+ * @return ssize_t err, so that the call can be returned directly
+ */
+static ssize_t stats_error(struct heartydev_device *hd, ssize_t err) {
+    this_cpu_inc(hd->stats->errors);
+    return err;
+}
+
+/**
+ * @brief Sum the per-CPU counters of a device
+ *
+ * @param hd the device
+ * @param out the snapshot to fill in, except for buf_len
+ */
+static void stats_sum(struct heartydev_device *hd, struct heartydev_stats *out) {
+    struct heartydev_pcpu_stats *s;
+    int cpu, i;
+
+    memset(out, 0, sizeof(*out));
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(hd->stats, cpu);
+        out->reads += READ_ONCE(s->reads);
+        out->writes += READ_ONCE(s->writes);
+        out->bytes_in += READ_ONCE(s->bytes_in);
+        out->bytes_out += READ_ONCE(s->bytes_out);
+        for (i = 0; i < HEARTYDEV_MAX_MODES; i++)
+            out->transform_bytes[i] += READ_ONCE(s->transform_bytes[i]);
+        out->errors += READ_ONCE(s->errors);
     }
-    memset(message, 0, MESSAGE_MAX_LEN);
-    message_capacity = MESSAGE_MAX_LEN;
-    message_len = 0;
+}
 
-    /* ********* Kernel Version 5.8.0-63-generic ********* */
-    heartydev_class = class_create(THIS_MODULE, "heartydev");
-    heartydev_class->dev_uevent = heartydev_uevent;
-    cdev_init(&heartydev_cdev, &heartydev_fops);
-    cdev_add(&heartydev_cdev, MKDEV(MAJOR(dev), 0), 1);
-    device_create(heartydev_class, NULL, MKDEV(MAJOR(dev), 0), NULL,
-                  "heartydev");
-    printk(KERN_INFO "----heartydev INIT END----\n");
+/**
+ * @brief Mode a newly opened file of a device starts in
+ *
+ * @param hd the device
+ * @return int the mode set through sysfs, or else default_mode, or UPPER
+ *         if default_mode is not a valid mode
+ */
+static int heartydev_default_mode(struct heartydev_device *hd) {
+    int mode = READ_ONCE(hd->mode);
 
-    return 0;
+    if (mode < 0)
+        mode = READ_ONCE(default_mode);
+    return xform_get(mode) ? mode : HEARTYDEV_UPPER;
 }
 
-/** 
- * @brief Exit the device driver
+/**
+ * @brief Histogram bucket of a latency
+ *
+ * @param ns the latency in nanoseconds
+ * @return unsigned int the bucket
  */
-static void __exit heartydev_exit(void) {
-    device_destroy(heartydev_class, MKDEV(MAJOR(dev), 0));
-    class_unregister(heartydev_class);
-    class_destroy(heartydev_class);
-    unregister_chrdev_region(MKDEV(MAJOR(dev), 0), MINORMASK);
-    printk(KERN_DEBUG "----heartydev memory free----\n");
-    kfree(message);
+static inline unsigned int latency_bucket(u64 ns) {
+    return min_t(unsigned int, fls64(ns), HIST_BUCKETS - 1);
 }
 
-/** 
- * @brief Open the device driver
- * 
- * @param inode the inode
- * @param file the file
- * @return int 0 if successful
+/**
+ * @brief Start timing an operation
+ *
+ * @param traced whether the tracepoint of the operation is enabled
+ * @return u64 the current time, or 0 if nobody needs the latency
  */
-static int heartydev_open(struct inode *inode, struct file *file) {
-    printk("heartydev_open\n");
+static inline u64 latency_start(bool traced) {
+    if (traced || static_branch_unlikely(&latency_key))
+        return ktime_get_ns();
     return 0;
 }
 
-/** 
- * @brief Release the device driver
- * 
- * @param inode the inode
- * @param file the file
- * @return int 0 if successful
+/**
+ * @brief Count the latency of an operation in its histogram
+ *
+ * @param hd the device
+ * @param op the HIST_* operation
+ * @param ns the latency in nanoseconds
  */
-static int heartydev_release(struct inode *inode, struct file *file) {
-    printk("heartydev_release\n");
-    printk(KERN_INFO "heartydev: Total writes: %d, Total reads: %d\n", write_count, read_count);
-    return 0;
+static inline void latency_record(struct heartydev_device *hd, int op, u64 ns) {
+    if (static_branch_unlikely(&latency_key))
+        this_cpu_inc(hd->stats->latency[op].buckets[latency_bucket(ns)]);
 }
 
-/** 
- * @brief IOCTL function for the device driver
- * 
- * @param file the file
- * @param cmd the command
- * @param arg the argument
- * @return long 0 if successful
+/**
+ * @brief Start timing a transform step
+ *
+ * @return u64 the current time, or 0 if the histograms are disabled
  */
-static long heartydev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
-{
-    char __user *user_buf;
-    int mode;
+static inline u64 transform_start(void) {
+    return static_branch_unlikely(&latency_key) ? ktime_get_ns() : 0;
+}
 
-    switch (cmd) {
-    case HEARTYDEV_WRITE_CNT:
-        printk("heartydev: Write count %d\n", write_count);
-        return write_count;
+/**
+ * @brief Count a transform step started with transform_start()
+ *
+ * @param start the value transform_start() returned
+ */
+static inline void transform_end(u64 start) {
+    if (start)
+        this_cpu_inc(transform_hist.buckets[latency_bucket(ktime_get_ns() -
+                                                           start)]);
+}
 
-    case HEARTYDEV_READ_CNT:
-        printk("heartydev: Read count %d\n", read_count);
-        return read_count;
+/**
+ * @brief Allocate an empty version with room for a number of pages
+ *
+ * @param nr_pages the number of page slots
+ * @return struct heartydev_store* the version, or NULL
+ */
+static struct heartydev_store *store_alloc(size_t nr_pages) {
+    return kvzalloc(struct_size((struct heartydev_store *)NULL, pages, nr_pages),
+                    GFP_KERNEL);
+}
 
-    case HEARTYDEV_BUF_LEN:
-        if (!access_ok((int __user *)arg, sizeof(int))) {
-            pr_err("heartydev: Invalid user space pointer for buffer length\n");
-            return -EFAULT;
-        }
-        if (copy_to_user((int __user *)arg, &message_len, sizeof(int))) {
-            pr_err("heartydev: Failed to copy buffer length to user space\n");
-            return -EFAULT;
-        }
-        printk("heartydev: Buffer length is %d\n", message_len);
-        return message_len;
-    
-    case HEARTYDEV_SET_MODE:
-        if (get_user(mode, (int __user *)arg)) {
-            pr_err("heartydev: Failed to get mode from user space\n");
-            return -EFAULT;
-        }
+/**
+ * @brief Allocate a zeroed page for a version
+ *
+ * The page is placed on the node of the calling CPU, which is the writer
+ * for buffer pages and the first reader for views, whatever the memory
+ * policy of the task. The page allocator is tried first without reclaim.
+ * When that fails the page comes from the reserve of heartydev_page_pool,
+ * so writes under memory pressure do not stall in reclaim until the
+ * reserve runs dry.
+ *
+ * @return struct page* the page, or NULL
+ */
+static struct page *store_page_alloc(void) {
+    int nid = numa_node_id();
+    struct page *page;
 
-        if (mode < HEARTYDEV_NORMAL || mode > HEARTYDEV_LOWER)
-            return -EINVAL;
+    page = alloc_pages_node(nid, GFP_NOWAIT | __GFP_NOWARN, 0);
+    if (!page && heartydev_page_pool)
+        page = mempool_alloc(heartydev_page_pool, GFP_NOWAIT | __GFP_NOWARN);
+    if (!page)
+        page = alloc_pages_node(nid, GFP_KERNEL, 0);
+    if (page)
+        clear_highpage(page);
+    return page;
+}
 
-        current_mode = mode;
-        pr_info("heartydev: mode set to %d\n", current_mode);
-        return 0;
+/**
+ * @brief Drop a reference to a page of a version
+ *
+ * A page nobody else references, neither a mapping nor a pipe, goes back
+ * to the reserve if it is short. Such a page is no longer reachable from
+ * any published version, so no new reference can appear.
+ *
+ * @param page the page
+ */
+static void store_page_free(struct page *page) {
+    if (heartydev_page_pool && page_ref_count(page) == 1)
+        mempool_free(page, heartydev_page_pool);
+    else
+        put_page(page);
+}
 
-    default:
-        return -ENOTTY;
+/**
+ * @brief Free the cached views of a version
+ *
+ * @param st the version
+ */
+static void store_views_free(struct heartydev_store *st) {
+    size_t i;
+    int mode, nid;
+
+    if (st->replicas) {
+        for (nid = 0; nid < nr_node_ids; nid++) {
+            if (!st->replicas[nid])
+                continue;
+            for (i = 0; i < st->nr_pages; i++)
+                if (st->replicas[nid][i])
+                    store_page_free(st->replicas[nid][i]);
+            kvfree(st->replicas[nid]);
+        }
+        kfree(st->replicas);
+    }
+
+    for (mode = 0; mode < HEARTYDEV_MAX_MODES; mode++) {
+        if (!st->views[mode])
+            continue;
+        for (i = 0; i < st->nr_pages; i++)
+            if (st->views[mode][i])
+                store_page_free(st->views[mode][i]);
+        kvfree(st->views[mode]);
     }
 }
 
-/** 
- * @brief Read function for the device driver
- * 
- * @param file the file
- * @param buf the buffer
- * @param count the count
- * @param offset the offset
+/**
+ * @brief Free a version that is no longer published, and all its pages
+ *
+ * @param st the version
  */
-static ssize_t heartydev_read(struct file *file, char __user *buf, size_t count,
-                              loff_t *offset) {
-    ssize_t bytes_to_read;
-    char *temp_buf;
-    size_t i = 0;
-    
-    if (!message) {
-        pr_err("heartydev: message buffer is NULL\n");
-        return -ENOMEM;
-    }
-    
-    if (offset != NULL && *offset >= message_len) {
-        return 0;
+static void store_destroy(struct heartydev_store *st) {
+    size_t i;
+
+    if (!st)
+        return;
+    store_views_free(st);
+    for (i = 0; i < st->nr_pages; i++) {
+        if (st->pages[i])
+            store_page_free(st->pages[i]);
+        if (st->zpages)
+            kfree(st->zpages[i]);
     }
-    
-    bytes_to_read = min(message_len - (offset ? *offset : 0), count);
-    if (bytes_to_read <= 0) {
+    kvfree(st->zpages);
+    kvfree(st);
+}
+
+/**
+ * @brief SRCU callback freeing a retired version
+ *
+ * Only the pages the next version dropped are released; the others live
+ * on in the next version. Pages that are still mapped into user space
+ * stay alive until they are unmapped.
+ *
+ * @param rcu the rcu head of the version
+ */
+static void store_free_rcu(struct rcu_head *rcu) {
+    struct heartydev_store *st = container_of(rcu, struct heartydev_store, rcu);
+    size_t i;
+
+    store_views_free(st);
+    for (i = 0; i < st->nr_retired; i++)
+        if (st->retired[i])
+            store_page_free(st->retired[i]);
+    if (st->retired != st->pages)
+        kvfree(st->retired);
+    for (i = 0; i < st->nr_zretired; i++)
+        kfree(st->zretired[i]);
+    if (st->zretired != st->zpages)
+        kvfree(st->zretired);
+    kvfree(st->zpages);
+    kvfree(st);
+}
+
+/**
+ * @brief Publish a new version and retire the old one
+ *
+ * Must be called with message_lock held, after old->retired has been
+ * filled in. Mappings of the pages in [first, last] are torn down so that
+ * the next access faults in the new pages.
+ *
+ * @param hd the device
+ * @param slot where the version is published
+ * @param st the new version
+ * @param old the version being replaced
+ * @param first the first page offset to unmap
+ * @param last the last page offset to unmap
+ */
+static void store_publish(struct heartydev_device *hd,
+                          struct heartydev_store __rcu **slot,
+                          struct heartydev_store *st,
+                          struct heartydev_store *old,
+                          pgoff_t first, pgoff_t last) {
+    struct address_space *mapping = READ_ONCE(hd->mapping);
+
+    down_write(&hd->map_sem);
+    rcu_assign_pointer(*slot, st);
+    if (mapping && first <= last)
+        unmap_mapping_range(mapping, (loff_t)first << PAGE_SHIFT,
+                            (loff_t)(last - first + 1) << PAGE_SHIFT, 1);
+    up_write(&hd->map_sem);
+
+    call_srcu(&message_srcu, &old->rcu, store_free_rcu);
+}
+
+/**
+ * @brief Replace a slot with an empty version
+ *
+ * Must be called with message_lock held.
+ *
+ * @param hd the device
+ * @param slot the slot to empty
+ * @param first the first page offset of the slot's mappings
+ * @return int 0 if successful, -ENOMEM otherwise
+ */
+static int store_truncate(struct heartydev_device *hd,
+                          struct heartydev_store __rcu **slot, pgoff_t first) {
+    struct heartydev_store *old, *st;
+
+    old = rcu_dereference_protected(*slot,
+                                    lockdep_is_held(&hd->message_lock));
+    if (old->len == 0)
         return 0;
-    }
-    
-    temp_buf = kmalloc(bytes_to_read, GFP_KERNEL);
-    if (!temp_buf) {
-        pr_err("heartydev: Failed to allocate temporary buffer\n");
+
+    st = store_alloc(0);
+    if (!st)
         return -ENOMEM;
-    }
 
-    memcpy(temp_buf, message + (offset ? *offset : 0), bytes_to_read);
-
-    switch (current_mode) {
-    case HEARTYDEV_UPPER:
-        for (i = 0; i < bytes_to_read; i++)
-            if (temp_buf[i] >= 'a' && temp_buf[i] <= 'z')
-                temp_buf[i] -= 32;
-        break;
-    case HEARTYDEV_LOWER:
-        for (i = 0; i < bytes_to_read; i++)
-            if (temp_buf[i] >= 'A' && temp_buf[i] <= 'Z')
-                temp_buf[i] += 32;
-        break;
-    case HEARTYDEV_NORMAL:
-    default:
-        break;
+    old->retired = old->pages;
+    old->nr_retired = old->nr_pages;
+    if (old->zpages) {
+        old->zretired = old->zpages;
+        old->nr_zretired = old->nr_pages;
     }
+    store_publish(hd, slot, st, old, first, first + old->nr_pages - 1);
+    return 0;
+}
 
-    if (copy_to_user(buf, temp_buf, bytes_to_read)) {
-        pr_err("heartydev: Failed to copy data to user space\n");
-        kfree(temp_buf);
-        return -EFAULT;
-    }
+/**
+ * @brief Number of bytes a mode produces for every byte of the buffer
+ *
+ * @param mode the mode, which must be valid
+ * @return unsigned int the ratio of output to input bytes
+ */
+static inline unsigned int mode_ratio(int mode) {
+    return xform_get(mode)->ratio;
+}
 
-    if (offset) {
-        *offset += bytes_to_read;
-    }
-    kfree(temp_buf);
-    read_count++;
-    pr_debug("heartydev: Read %zd bytes, read_count=%d\n", bytes_to_read, read_count);
-    printk("heartydev: Read count %d\n", read_count);
+/**
+ * @brief Mode that reads through a file apply
+ *
+ * @param hf the file
+ * @return int the mode of the file, or NORMAL if the device transforms
+ *         on write and stores the transformed bytes
+ */
+static inline int read_mode(struct heartydev_file *hf) {
+    if (READ_ONCE(hf->dev->policy) == HEARTYDEV_POLICY_ON_WRITE)
+        return HEARTYDEV_NORMAL;
+    return READ_ONCE(hf->mode);
+}
 
-    return 0;
+/**
+ * @brief Take the staging buffers of a file for one read
+ *
+ * Several threads, or several io_uring requests, may read through one
+ * file at once, and scratch and zbuf belong to the file, so a read that
+ * stages its bytes or unpacks compressed pages there holds read_lock
+ * while it does.
+ *
+ * @param hf the file
+ * @param iocb the I/O control block of the read
+ * @return int 0, or -EAGAIN if the read must not wait for another one
+ */
+static int read_bufs_lock(struct heartydev_file *hf, struct kiocb *iocb) {
+    if (!(iocb->ki_flags & IOCB_NOWAIT)) {
+        mutex_lock(&hf->read_lock);
+        return 0;
+    }
+    return mutex_trylock(&hf->read_lock) ? 0 : -EAGAIN;
 }
 
-/** 
- * @brief Write function for the device driver
- * 
- * @param file the file
- * @param buf the buffer
- * @param count the count
- * @param offset the offset
+/**
+ * @brief Mode that writes to a device apply
+ *
+ * Must be called with message_lock or ring_lock held, since the policy
+ * only changes with both locks held.
+ *
+ * @param hd the device
+ * @return int the write mode of the device, or NORMAL if it transforms on
+ *         read
  */
-static ssize_t heartydev_write(struct file *file, const char __user *buf,
-                               size_t count, loff_t *offset) {
+static inline int write_mode(struct heartydev_device *hd) {
+    if (hd->policy == HEARTYDEV_POLICY_ON_WRITE)
+        return hd->write_mode;
+    return HEARTYDEV_NORMAL;
+}
 
-    printk("heartydev_write called\n");
+/**
+ * @brief Apply a device mode while copying a buffer
+ *
+ * @param dst the destination, len * mode_ratio(mode) bytes; it may be
+ *        equal to src if the ratio is 1
+ * @param src the source
+ * @param len the length of the buffer
+ * @param mode the mode to apply, which must be valid
+ * @param table the lookup table of the file
+ */
+static void heartydev_transform(char *dst, const char *src, size_t len,
+                                int mode, const u8 *table) {
+    u64 start = transform_start();
 
-    if (count > MESSAGE_MAX_LEN - 1)
-        count = MESSAGE_MAX_LEN - 1;
+    xform_get(mode)->fn(dst, src, len, table);
+    transform_end(start);
+}
 
-    if (copy_from_user(message, buf, count)) {
-        pr_err("heartydev: Failed to copy data from user space\n");
-        return -EFAULT;
+/**
+ * @brief Find the user memory behind the current segment of an iterator
+ *
+ * @param i the iterator
+ * @param len set to the bytes left in the segment
+ * @return void __user* the next byte of the segment, or NULL if the
+ *         iterator is not backed by user memory
+ */
+static void __user *iter_user_seg(struct iov_iter *i, size_t *len) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    if (iter_is_ubuf(i)) {
+        *len = iov_iter_count(i);
+        return i->ubuf + i->iov_offset;
     }
+#endif
+    if (iter_is_iovec(i)) {
+        *len = min(iov_iter_count(i), i->iov->iov_len - i->iov_offset);
+        return i->iov->iov_base + i->iov_offset;
+    }
+    return NULL;
+}
 
-    message[count] = '\0';
-    message_len = count;
-    write_count++;
-    printk("heartydev: Write count %d\n", write_count);
-
-    return message_len;
+/**
+ * @brief Copy from an iterator while applying a mode
+ *
+ * User memory is transformed on its way in, a page at a time, so each
+ * byte is converted while it is still in the cache or, for modes with
+ * fused copies, in a register. Other iterators are copied first and then
+ * converted in place.
+ *
+ * @param dst the destination
+ * @param len the number of bytes
+ * @param from the source
+ * @param mode a mode with a ratio of 1
+ * @param table the table of the mode
+ * @return size_t the number of bytes copied
+ */
+static size_t transform_from_iter(char *dst, size_t len, struct iov_iter *from,
+                                  int mode, const u8 *table) {
+    const struct xform_ops *ops = xform_get(mode);
+    size_t seg, n, left, done = 0;
+    void __user *base;
+    u64 start;
+
+    while (done < len && iov_iter_count(from)) {
+        base = iter_user_seg(from, &seg);
+        if (!base || !seg) {
+            /* kernel memory, or an empty segment for the generic copy */
+            n = copy_from_iter(dst + done, min_t(size_t, len - done, PAGE_SIZE),
+                               from);
+            ops->fn(dst + done, dst + done, n, table);
+            done += n;
+            if (!n)
+                break;
+            continue;
+        }
+        n = min3(len - done, seg, PAGE_SIZE);
+        start = transform_start();
+        left = xform_from_user(ops, dst + done, base, n, table);
+        transform_end(start);
+        iov_iter_advance(from, n - left);
+        done += n - left;
+        if (left)
+            break;
+    }
+    return done;
+}
+
+/**
+ * @brief Copy to an iterator in one pass while applying a mode
+ *
+ * @param to the destination, backed by user memory
+ * @param src the source
+ * @param len the number of bytes
+ * @param ops a transform with fused copies
+ * @return size_t the number of bytes copied, or 0 if the current segment
+ *         cannot be written this way
+ */
+static size_t fused_to_iter(struct iov_iter *to, const char *src, size_t len,
+                            const struct xform_ops *ops) {
+    size_t seg, left;
+    void __user *base = iter_user_seg(to, &seg);
+    u64 start;
+
+    if (!base || !seg)
+        return 0;
+    len = min(len, seg);
+    start = transform_start();
+    left = ops->to_user(base, src, len);
+    transform_end(start);
+    iov_iter_advance(to, len - left);
+    return len - left;
+}
+
+/**
+ * @brief Unpack the start of a compressed page
+ *
+ * @param z the compressed page
+ * @param dst a buffer of PAGE_SIZE bytes
+ * @param upto the number of bytes needed; more may be unpacked
+ */
+static void zpage_unpack(const struct heartydev_zpage *z, char *dst,
+                         size_t upto) {
+    int ret = LZ4_decompress_safe_partial(z->data, dst, z->len, upto,
+                                          PAGE_SIZE);
+
+    /* the data was compressed here, so this only fails on a bug */
+    if (WARN_ON_ONCE(ret < 0 || (size_t)ret < upto))
+        memset(dst, 0, PAGE_SIZE);
+}
+
+/**
+ * @brief Compress a full page of a new version if it pays off
+ *
+ * The page stays as it is unless LZ4 shrinks it to ZPAGE_MAX bytes or
+ * less. A page the new version shares with the old one goes to the pages
+ * the old version drops, since its readers may still be looking at it; a
+ * page of the new version alone is freed right away. Must be called with
+ * message_lock held, which also covers the LZ4 state of the device.
+ *
+ * @param hd the device
+ * @param st the new version, not yet published
+ * @param old the version it replaces
+ * @param idx the page index
+ * @param retired the pages old drops, appended to
+ */
+static void store_compress_page(struct heartydev_device *hd,
+                                struct heartydev_store *st,
+                                struct heartydev_store *old, size_t idx,
+                                struct page **retired) {
+    struct page *page = st->pages[idx];
+    struct heartydev_zpage *z;
+    int len;
+
+    len = LZ4_compress_default(page_address(page), hd->zbounce, PAGE_SIZE,
+                               LZ4_COMPRESSBOUND(PAGE_SIZE), hd->zwork);
+    if (len <= 0 || len > ZPAGE_MAX)
+        return;
+    z = kmalloc(struct_size(z, data, len), GFP_KERNEL | __GFP_NOWARN);
+    if (!z)
+        return;
+    z->len = len;
+    memcpy(z->data, hd->zbounce, len);
+
+    st->zpages[idx] = z;
+    st->pages[idx] = NULL;
+    st->nr_zpages++;
+    st->zbytes += len;
+    if (idx < old->nr_pages && old->pages[idx] == page)
+        retired[old->nr_retired++] = page;
+    else
+        store_page_free(page);
+}
+
+/**
+ * @brief Carry the cached views of a version over to the next one
+ *
+ * Pages the new version shares with the old one keep their view pages.
+ * A shared page only ever changes past old->len, where appends fill it in
+ * place, so just the bytes from old->len up to the new end are transformed
+ * into the view page, in place as well: readers of the old version never
+ * look past old->len. Pages that were copied or are new start without a
+ * view, as before. An append therefore transforms only the appended bytes,
+ * and the views of the rest of the buffer stay warm. Must be called with
+ * message_lock held, before st is published.
+ *
+ * @param st the new version
+ * @param old the version it replaces
+ */
+static void store_views_inherit(struct heartydev_store *st,
+                                struct heartydev_store *old) {
+    size_t nr = min(old->nr_pages, st->nr_pages), i, start, end;
+    struct page **view, *page;
+    int mode;
+
+    for (mode = 0; mode < HEARTYDEV_MAX_MODES; mode++) {
+        view = smp_load_acquire(&old->views[mode]);
+        if (!view)
+            continue;
+        st->views[mode] = kvcalloc(st->nr_pages, sizeof(*view), GFP_KERNEL);
+        if (!st->views[mode])
+            continue;
+        for (i = 0; i < nr; i++) {
+            page = smp_load_acquire(&view[i]);
+            if (!page || st->pages[i] != old->pages[i])
+                continue;
+            start = max_t(size_t, old->len, i * PAGE_SIZE);
+            end = min_t(size_t, st->len, (i + 1) * PAGE_SIZE);
+            if (start < end)
+                heartydev_transform(page_address(page) + start % PAGE_SIZE,
+                                    page_address(st->pages[i]) +
+                                    start % PAGE_SIZE, end - start, mode,
+                                    NULL);
+            get_page(page);
+            st->views[mode][i] = page;
+        }
+    }
+}
+
+/**
+ * @brief Copy the bytes of a page that a write leaves alone
+ *
+ * @param dst the page of the new version
+ * @param src the data of the page in the old version
+ * @param len the bytes of data in the old page
+ * @param lo the first byte of the page the write covers
+ * @param hi the byte of the page past the write
+ */
+static void store_copy_around(char *dst, const char *src, size_t len,
+                              size_t lo, size_t hi) {
+    memcpy(dst, src, min(lo, len));
+    if (hi < len)
+        memcpy(dst + hi, src + hi, len - hi);
+}
+
+/**
+ * @brief Write data into the message buffer
+ *
+ * Builds the next version of the message buffer. Pages whose existing data
+ * is overwritten are copied first, pages past the end are allocated zeroed,
+ * and bytes past the current end of the last page are filled in place. The
+ * new bytes are transformed with mode as they are copied in, with the table
+ * of the device for HEARTYDEV_LUT. With compress, compressed pages are
+ * unpacked into the copies, and the pages the write filled up are
+ * compressed before the version is published. Must be called with
+ * message_lock held.
+ *
+ * With spages the new bytes are already in pages of their own, zeroed
+ * around the data, which starts at pos % PAGE_SIZE in the first one. The
+ * new version takes those pages instead of copying, and only the bytes
+ * of the old version they share a page with, at most a page at either
+ * end, are copied into them.
+ *
+ * @param hd the device
+ * @param from the source of the data, advanced past what was written, or
+ *        NULL with spages
+ * @param pos the offset within the message buffer
+ * @param count the number of bytes to write
+ * @param mode the mode to store the bytes in, unused with spages
+ * @param spages the staged pages, which the new version keeps if the
+ *        write succeeds, or NULL
+ * @return ssize_t the number of bytes written, or a negative error code
+ */
+static ssize_t store_write(struct heartydev_device *hd, struct iov_iter *from,
+                           size_t pos, size_t count, int mode,
+                           struct page **spages) {
+    struct heartydev_store *old, *st;
+    size_t end = pos + count, len, nr_pages, nr_old, i, lo, hi;
+    size_t first = pos / PAGE_SIZE, last = (end - 1) / PAGE_SIZE, zfirst;
+    size_t page_off, chunk, copied, written = 0;
+    pgoff_t cow_first = ULONG_MAX, cow_last = 0;
+    struct heartydev_zpage **zretired = NULL;
+    struct page **retired;
+    struct page *page;
+    char *src;
+    ssize_t ret = -ENOMEM;
+
+    old = rcu_dereference_protected(hd->message,
+                                    lockdep_is_held(&hd->message_lock));
+    nr_old = old->nr_pages;
+    nr_pages = max(nr_old, last + 1);
+
+    /* a write past the end also fills up the last page it did not touch */
+    zfirst = compress ? min(first, old->len / PAGE_SIZE) : first;
+
+    st = store_alloc(nr_pages);
+    retired = kvmalloc_array(last - zfirst + 1, sizeof(*retired), GFP_KERNEL);
+    if (!st || !retired)
+        goto fail;
+    memcpy(st->pages, old->pages, nr_old * sizeof(*st->pages));
+    st->nr_pages = nr_old;
+    if (compress) {
+        st->zpages = kvcalloc(nr_pages, sizeof(*st->zpages), GFP_KERNEL);
+        zretired = kvmalloc_array(last - first + 1, sizeof(*zretired),
+                                  GFP_KERNEL);
+        if (!st->zpages || !zretired)
+            goto fail;
+        if (old->zpages)
+            memcpy(st->zpages, old->zpages, nr_old * sizeof(*st->zpages));
+        st->nr_zpages = old->nr_zpages;
+        st->zbytes = old->zbytes;
+    }
+
+    /*
+     * copy the pages whose data this write overwrites; staged pages take
+     * the place of every page they cover and keep the bytes outside
+     */
+    for (i = first; i <= last && i < nr_old; i++) {
+        if (!spages && max_t(size_t, pos, i * PAGE_SIZE) >= old->len)
+            break;
+        page = spages ? spages[i - first] : store_page_alloc();
+        if (!page)
+            goto fail;
+        st->pages[i] = page;
+        len = min_t(size_t, old->len - i * PAGE_SIZE, PAGE_SIZE);
+        lo = spages ? max_t(size_t, pos, i * PAGE_SIZE) - i * PAGE_SIZE : len;
+        hi = spages ? min_t(size_t, end, (i + 1) * PAGE_SIZE) - i * PAGE_SIZE :
+                      len;
+        if (!old->pages[i]) {
+            src = spages ? hd->zbounce : page_address(page);
+            zpage_unpack(old->zpages[i], src, PAGE_SIZE);
+            zretired[old->nr_zretired++] = old->zpages[i];
+            st->zpages[i] = NULL;
+            st->nr_zpages--;
+            st->zbytes -= old->zpages[i]->len;
+        } else {
+            src = page_address(old->pages[i]);
+            retired[old->nr_retired++] = old->pages[i];
+        }
+        if (src != page_address(page))
+            store_copy_around(page_address(page), src, len, lo, hi);
+        cow_first = min_t(pgoff_t, cow_first, i);
+        cow_last = i;
+    }
+
+    /* pages past the end, including holes in front of pos */
+    for (; st->nr_pages < nr_pages; st->nr_pages++) {
+        i = st->nr_pages;
+        st->pages[i] = spages && i >= first ? spages[i - first] :
+                                              store_page_alloc();
+        if (!st->pages[i])
+            goto fail;
+    }
+
+    while (!spages && written < count) {
+        page_off = (pos + written) % PAGE_SIZE;
+        chunk = min_t(size_t, count - written, PAGE_SIZE - page_off);
+        page = st->pages[(pos + written) / PAGE_SIZE];
+        if (mode != HEARTYDEV_NORMAL)
+            copied = transform_from_iter(page_address(page) + page_off, chunk,
+                                         from, mode, hd->write_lut);
+        else
+            copied = copy_page_from_iter(page, page_off, chunk, from);
+        written += copied;
+        if (copied < chunk)
+            break;
+    }
+    if (spages)
+        written = count;
+    if (written == 0) {
+        pr_err_ratelimited("heartydev: Failed to copy data from user space\n");
+        ret = -EFAULT;
+        goto fail;
+    }
+
+    /* drop the fresh pages a short copy never reached */
+    len = max(old->len, pos + written);
+    while (st->nr_pages > max_t(size_t, nr_old, DIV_ROUND_UP(len, PAGE_SIZE)))
+        store_page_free(st->pages[--st->nr_pages]);
+    st->len = len;
+
+    store_views_inherit(st, old);
+
+    /* the pages this write filled up */
+    if (compress)
+        for (i = zfirst; i < min(len / PAGE_SIZE, last + 1); i++)
+            store_compress_page(hd, st, old, i, retired);
+
+    old->retired = retired;
+    old->zretired = zretired;
+    store_publish(hd, &hd->message, st, old, cow_first, cow_last);
+    return written;
+
+fail:
+    if (st) {
+        for (i = 0; i < st->nr_pages; i++)
+            if ((i >= nr_old || st->pages[i] != old->pages[i]) &&
+                !(spages && i >= first && i <= last))
+                store_page_free(st->pages[i]);
+        kvfree(st->zpages);
+        kvfree(st);
+    }
+    old->nr_retired = 0;
+    old->nr_zretired = 0;
+    kvfree(retired);
+    kvfree(zretired);
+    return ret;
+}
+
+/**
+ * @brief Look up a page of a version for a reader
+ *
+ * With numa_replicas, a reader on another node than the page copies it
+ * into memory of its own node the first time, and later readers on that
+ * node read the copy. Like views, the copies belong to the version and go
+ * away with it, and racing readers keep the first copy installed. Must be
+ * called within an SRCU read section of the version.
+ *
+ * @param st the version
+ * @param idx the page index
+ * @return struct page* a page with the contents of st->pages[idx], local
+ *         to the calling CPU where possible
+ */
+static struct page *store_read_page(struct heartydev_store *st, size_t idx) {
+    struct page *page = st->pages[idx], *copy, *old;
+    struct page ***replicas, ***others;
+    struct page **replica, **other;
+    int nid = numa_node_id();
+
+    if (!READ_ONCE(numa_replicas) || page_to_nid(page) == nid)
+        return page;
+
+    replicas = smp_load_acquire(&st->replicas);
+    if (!replicas) {
+        replicas = kcalloc(nr_node_ids, sizeof(*replicas), GFP_KERNEL);
+        if (!replicas)
+            return page;
+        others = cmpxchg(&st->replicas, NULL, replicas);
+        if (others) {
+            kfree(replicas);
+            replicas = others;
+        }
+    }
+
+    replica = smp_load_acquire(&replicas[nid]);
+    if (!replica) {
+        replica = kvcalloc(st->nr_pages, sizeof(*replica), GFP_KERNEL);
+        if (!replica)
+            return page;
+        other = cmpxchg(&replicas[nid], NULL, replica);
+        if (other) {
+            kvfree(replica);
+            replica = other;
+        }
+    }
+
+    copy = smp_load_acquire(&replica[idx]);
+    if (copy)
+        return copy;
+
+    copy = alloc_pages_node(nid, GFP_KERNEL | __GFP_THISNODE | __GFP_NOWARN, 0);
+    if (!copy)
+        return page;
+    copy_highpage(copy, page);
+    old = cmpxchg(&replica[idx], NULL, copy);
+    if (old) {
+        store_page_free(copy);
+        copy = old;
+    }
+    return copy;
+}
+
+/**
+ * @brief Contents of a page of a version, unpacking it if it is compressed
+ *
+ * Must be called within an SRCU read section of the version.
+ *
+ * @param st the version
+ * @param idx the page index
+ * @param buf a buffer of PAGE_SIZE bytes to unpack into
+ * @param upto the number of bytes of the page that are needed
+ * @return const char* the data of the page, which is buf if it was
+ *         compressed
+ */
+static const char *store_page_data(struct heartydev_store *st, size_t idx,
+                                   char *buf, size_t upto) {
+    if (!st->pages[idx]) {
+        zpage_unpack(st->zpages[idx], buf, upto);
+        return buf;
+    }
+    return page_address(store_read_page(st, idx));
+}
+
+/**
+ * @brief Copy bytes from a version into an iterator
+ *
+ * The range must lie within st->len.
+ *
+ * @param st the version
+ * @param to the destination, advanced past what was copied
+ * @param offset the offset within the version
+ * @param count the number of bytes to copy
+ * @param zbuf a page to unpack compressed pages into
+ * @return size_t the number of bytes actually copied
+ */
+static size_t store_copy_to_iter(struct heartydev_store *st,
+                                 struct iov_iter *to, size_t offset,
+                                 size_t count, char *zbuf) {
+    size_t page_off, chunk, copied, done = 0;
+    size_t idx;
+
+    while (done < count) {
+        page_off = offset % PAGE_SIZE;
+        chunk = min_t(size_t, count - done, PAGE_SIZE - page_off);
+        idx = offset / PAGE_SIZE;
+        if (st->pages[idx])
+            copied = copy_page_to_iter(store_read_page(st, idx), page_off,
+                                       chunk, to);
+        else
+            copied = copy_to_iter(store_page_data(st, idx, zbuf,
+                                                  page_off + chunk) + page_off,
+                                  chunk, to);
+        done += copied;
+        if (copied < chunk)
+            break;
+        offset += chunk;
+    }
+
+    return done;
+}
+
+/**
+ * @brief Look up a page of a cached view, rendering it if needed
+ *
+ * Readers race to fill the view without a lock: the first to install the
+ * page array or a page wins and the others drop their copy. Must be
+ * called within an SRCU read section of the version. Only modes that map
+ * a page to a page and do not depend on the file can be cached.
+ *
+ * @param st the version
+ * @param mode the mode of the view, other than NORMAL
+ * @param idx the page index
+ * @return struct page* the transformed page, or NULL if the mode cannot be
+ *         cached, caching is off or memory is short
+ */
+static struct page *store_view_page(struct heartydev_store *st, int mode,
+                                    size_t idx) {
+    const struct xform_ops *ops = xform_get(mode);
+    struct page **view, **other;
+    struct page *page, *old;
+    size_t len;
+
+    if (!READ_ONCE(cache_views) || ops->ratio != 1 ||
+        (ops->flags & XFORM_PER_FILE))
+        return NULL;
+
+    view = smp_load_acquire(&st->views[mode]);
+    if (!view) {
+        view = kvcalloc(st->nr_pages, sizeof(*view), GFP_KERNEL);
+        if (!view)
+            return NULL;
+        other = cmpxchg(&st->views[mode], NULL, view);
+        if (other) {
+            kvfree(view);
+            view = other;
+        }
+    }
+
+    page = smp_load_acquire(&view[idx]);
+    if (page)
+        return page;
+
+    page = store_page_alloc();
+    if (!page)
+        return NULL;
+    len = min_t(size_t, st->len - idx * PAGE_SIZE, PAGE_SIZE);
+    heartydev_transform(page_address(page),
+                        store_page_data(st, idx, page_address(page), len),
+                        len, mode, NULL);
+    old = cmpxchg(&view[idx], NULL, page);
+    if (old) {
+        store_page_free(page);
+        page = old;
+    }
+    return page;
+}
+
+/**
+ * @brief Transform bytes of a version on their way into an iterator
+ *
+ * Pages of the cached view are copied as they are, so after the first read
+ * in a mode the transform does not run again until the next write. Without
+ * a view, modes with fused copies transform straight into user memory as
+ * they copy. Otherwise the bytes are transformed into a scratch buffer of
+ * SCRATCH_SIZE bytes one chunk at a time, so no allocation is needed
+ * however large the read is. Such a chunk never spans two segments of the
+ * destination, so each segment of a readv() gets its own transform and
+ * copy.
+ *
+ * For modes that produce several bytes per input byte, offset and count
+ * are in output bytes, and the range must lie within st->len times the
+ * ratio of the mode.
+ *
+ * @param st the version
+ * @param to the destination, advanced past what was copied
+ * @param offset the offset within the output of the mode
+ * @param count the number of bytes to copy
+ * @param mode the mode to apply
+ * @param scratch the scratch buffer
+ * @param zbuf a page to unpack compressed pages into
+ * @param table the lookup table of the file
+ * @return size_t the number of bytes actually copied
+ */
+static size_t store_transform_to_iter(struct heartydev_store *st,
+                                      struct iov_iter *to, size_t offset,
+                                      size_t count, int mode, char *scratch,
+                                      char *zbuf, const u8 *table) {
+    const struct xform_ops *ops = xform_get(mode);
+    unsigned int ratio = ops->ratio;
+    size_t src, skip, n, chunk, seg, copied, done = 0;
+    struct page *page;
+
+    while (done < count) {
+        if (ratio == 1) {
+            chunk = min_t(size_t, count - done, PAGE_SIZE - offset % PAGE_SIZE);
+            page = store_view_page(st, mode, offset / PAGE_SIZE);
+            if (page) {
+                copied = copy_page_to_iter(page, offset % PAGE_SIZE, chunk, to);
+                done += copied;
+                if (copied < chunk)
+                    break;
+                offset += chunk;
+                continue;
+            }
+            if (ops->to_user) {
+                copied = fused_to_iter(to, store_page_data(st,
+                                       offset / PAGE_SIZE, zbuf,
+                                       offset % PAGE_SIZE + chunk) +
+                                       offset % PAGE_SIZE, chunk, ops);
+                done += copied;
+                offset += copied;
+                if (copied)
+                    continue;
+            }
+        }
+
+        /* n source bytes, of whose output the first skip bytes were read */
+        src = offset / ratio;
+        skip = offset % ratio;
+        n = min_t(size_t, PAGE_SIZE - src % PAGE_SIZE, SCRATCH_SIZE / ratio);
+        n = min_t(size_t, n, DIV_ROUND_UP(count - done + skip, ratio));
+        seg = iov_iter_single_seg_count(to);
+        if (seg)
+            n = min_t(size_t, n, DIV_ROUND_UP(seg + skip, ratio));
+        heartydev_transform(scratch,
+                            store_page_data(st, src / PAGE_SIZE, zbuf,
+                                            src % PAGE_SIZE + n) +
+                            src % PAGE_SIZE, n, mode, table);
+
+        chunk = min_t(size_t, n * ratio - skip, count - done);
+        if (seg)
+            chunk = min(chunk, seg);
+        copied = copy_to_iter(scratch + skip, chunk, to);
+        done += copied;
+        if (copied < chunk)
+            break;
+        offset += chunk;
+    }
+
+    return done;
+}
+
+/**
+ * @brief Transform one chunk of a parallel read
+ *
+ * @param work the work item of the chunk
+ */
+static void parallel_work(struct work_struct *work) {
+    struct heartydev_par_chunk *chunk =
+        container_of(work, struct heartydev_par_chunk, work);
+    struct heartydev_par *par = chunk->par;
+    unsigned int ratio = mode_ratio(par->mode);
+    size_t src = chunk->start, n;
+
+    while (src < chunk->end) {
+        n = min_t(size_t, chunk->end - src, PAGE_SIZE - src % PAGE_SIZE);
+        if (!par->out)
+            store_view_page(par->st, par->mode, src / PAGE_SIZE);
+        else
+            heartydev_transform(par->out + (src - par->base) * ratio,
+                                store_page_data(par->st, src / PAGE_SIZE,
+                                                chunk->zbuf,
+                                                src % PAGE_SIZE + n) +
+                                src % PAGE_SIZE, n, par->mode, par->table);
+        src += n;
+    }
+}
+
+/**
+ * @brief Transform a large read on several CPUs before copying it out
+ *
+ * The pages under the read are split into at most parallel_fanout chunks
+ * of at most PARALLEL_CHUNK bytes each, so the read is done in windows of
+ * up to that many chunks, one after the other. Modes with a cached view
+ * fill the view of a window in parallel, and it is then copied from the
+ * view as usual. Other modes are transformed into a temporary buffer the
+ * size of one window, which is copied out before the next window is
+ * transformed. If memory is short, or the read covers too few pages to
+ * split, the read is transformed on the calling CPU. Must be called
+ * within an SRCU read section of the version, which the chunks finish in
+ * as well.
+ *
+ * @param st the version
+ * @param to the destination, advanced past what was copied
+ * @param offset the offset within the output of the mode
+ * @param count the number of bytes to copy
+ * @param mode the mode to apply, other than NORMAL
+ * @param hf the file reading
+ * @return size_t the number of bytes actually copied
+ */
+static size_t parallel_transform_to_iter(struct heartydev_store *st,
+                                         struct iov_iter *to, size_t offset,
+                                         size_t count, int mode,
+                                         struct heartydev_file *hf) {
+    const struct xform_ops *ops = xform_get(mode);
+    size_t start = offset / ops->ratio;
+    size_t end = DIV_ROUND_UP(offset + count, ops->ratio);
+    size_t base = round_down(start, PAGE_SIZE);
+    size_t nr_pages = DIV_ROUND_UP(end - base, PAGE_SIZE), per_chunk;
+    size_t window, wend, len, copied, done = 0;
+    bool views = READ_ONCE(cache_views) && ops->ratio == 1 &&
+                 !(ops->flags & XFORM_PER_FILE);
+    struct heartydev_par *par;
+    bool ran = false;
+    unsigned int n, nr, i;
+
+    n = min3((size_t)READ_ONCE(parallel_fanout), (size_t)num_online_cpus(),
+             nr_pages);
+    if (n < 2)
+        goto serial;
+    per_chunk = min_t(size_t, DIV_ROUND_UP(nr_pages, n),
+                      PARALLEL_CHUNK / PAGE_SIZE) * PAGE_SIZE;
+    window = n * per_chunk;
+
+    par = kzalloc(struct_size(par, chunks, n), GFP_KERNEL);
+    if (!par)
+        goto serial;
+    par->st = st;
+    par->mode = mode;
+    par->table = hf->lut;
+    par->nr_chunks = n;
+    if (!views) {
+        par->out = kvmalloc(window * ops->ratio, GFP_KERNEL);
+        if (!par->out)
+            goto free;
+    }
+    for (i = 0; i < n; i++) {
+        par->chunks[i].par = par;
+        INIT_WORK(&par->chunks[i].work, parallel_work);
+        if (compress && !views) {
+            par->chunks[i].zbuf = (char *)__get_free_page(GFP_KERNEL);
+            if (!par->chunks[i].zbuf)
+                goto free;
+        }
+    }
+
+    ran = true;
+    while (done < count) {
+        wend = min(end, base + window);
+        nr = DIV_ROUND_UP(wend - base, per_chunk);
+        par->base = base;
+        for (i = 0; i < nr; i++) {
+            par->chunks[i].start = max(start, base + i * per_chunk);
+            par->chunks[i].end = min(wend, base + (i + 1) * per_chunk);
+        }
+        for (i = 1; i < nr; i++)
+            queue_work(system_unbound_wq, &par->chunks[i].work);
+        parallel_work(&par->chunks[0].work);
+        for (i = 1; i < nr; i++)
+            flush_work(&par->chunks[i].work);
+
+        /* the output of the window, past what earlier ones copied */
+        len = min(count - done, wend * ops->ratio - (offset + done));
+        if (views)
+            copied = store_transform_to_iter(st, to, offset + done, len, mode,
+                                             hf->scratch, hf->zbuf, hf->lut);
+        else
+            copied = copy_to_iter(par->out + offset + done -
+                                  base * ops->ratio, len, to);
+        done += copied;
+        if (copied < len)
+            break;
+        base = start = wend;
+    }
+
+free:
+    for (i = 0; i < par->nr_chunks; i++)
+        free_page((unsigned long)par->chunks[i].zbuf);
+    kvfree(par->out);
+    kfree(par);
+    if (ran)
+        return done;
+serial:
+    return store_transform_to_iter(st, to, offset, count, mode, hf->scratch,
+                                   hf->zbuf, hf->lut);
+}
+
+/**
+ * @brief Length of the current version of the message buffer
+ *
+ * @param hd the device
+ * @return size_t the number of bytes in the message buffer
+ */
+static size_t message_len(struct heartydev_device *hd) {
+    size_t len;
+    int idx;
+
+    idx = srcu_read_lock(&message_srcu);
+    len = srcu_dereference(hd->message, &message_srcu)->len;
+    srcu_read_unlock(&message_srcu, idx);
+
+    return len;
+}
+
+/**
+ * @brief Render the message buffer with a mode
+ *
+ * The output goes to fresh pages that replace the previous rendering, so
+ * a reader of HEARTYDEV_MMAP_RENDERED never sees a half-rendered page.
+ * The rendering keeps the offsets of the buffer, so modes that change the
+ * length cannot be rendered.
+ *
+ * @param hd the device
+ * @param mode the mode to render with
+ * @param table the lookup table of the file
+ * @return long the number of rendered bytes, or a negative error code
+ */
+static long heartydev_render(struct heartydev_device *hd, int mode,
+                             const u8 *table) {
+    const pgoff_t rendered_pgoff = HEARTYDEV_MMAP_RENDERED >> PAGE_SHIFT;
+    struct heartydev_store *src, *old, *st;
+    size_t i, chunk;
+    long ret;
+
+    if (mode_ratio(mode) != 1)
+        return -EOPNOTSUPP;
+
+    mutex_lock(&hd->message_lock);
+    src = rcu_dereference_protected(hd->message,
+                                    lockdep_is_held(&hd->message_lock));
+    old = rcu_dereference_protected(hd->rendered,
+                                    lockdep_is_held(&hd->message_lock));
+
+    st = store_alloc(src->nr_pages);
+    if (!st) {
+        mutex_unlock(&hd->message_lock);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < src->nr_pages; i++) {
+        st->pages[i] = store_page_alloc();
+        if (!st->pages[i]) {
+            store_destroy(st);
+            mutex_unlock(&hd->message_lock);
+            return -ENOMEM;
+        }
+        st->nr_pages++;
+        chunk = min_t(size_t, src->len - i * PAGE_SIZE, PAGE_SIZE);
+        heartydev_transform(page_address(st->pages[i]),
+                            store_page_data(src, i,
+                                            page_address(st->pages[i]), chunk),
+                            chunk, mode, table);
+    }
+    st->len = src->len;
+
+    old->retired = old->pages;
+    old->nr_retired = old->nr_pages;
+    store_publish(hd, &hd->rendered, st, old, rendered_pgoff,
+                  rendered_pgoff + old->nr_pages - 1);
+    ret = st->len;
+    mutex_unlock(&hd->message_lock);
+
+    return ret;
+}
+
+/**
+ * @brief Page fault handler for mappings of the device
+ *
+ * The page is inserted while the map_sem of the device is held, so a
+ * write that replaces it either happens before and is seen here, or after
+ * and tears the new mapping down again.
+ *
+ * @param vmf the fault
+ * @return vm_fault_t VM_FAULT_NOPAGE, or VM_FAULT_SIGBUS past the data
+ */
+static vm_fault_t heartydev_vm_fault(struct vm_fault *vmf) {
+    struct vm_area_struct *vma = vmf->vma;
+    struct heartydev_file *hf = vma->vm_file->private_data;
+    struct heartydev_device *hd = hf->dev;
+    struct heartydev_store __rcu **slot = vma->vm_private_data;
+    struct heartydev_store *st;
+    pgoff_t idx = vmf->pgoff;
+    int err;
+
+    if (slot == &hd->rendered)
+        idx -= HEARTYDEV_MMAP_RENDERED >> PAGE_SHIFT;
+
+    down_read(&hd->map_sem);
+    st = rcu_dereference_protected(*slot, lockdep_is_held(&hd->map_sem));
+    if (idx >= st->nr_pages) {
+        up_read(&hd->map_sem);
+        return VM_FAULT_SIGBUS;
+    }
+    err = vm_insert_page(vma, vmf->address, st->pages[idx]);
+    up_read(&hd->map_sem);
+
+    /* -EBUSY means another thread mapped the page first */
+    if (err && err != -EBUSY)
+        return vmf_error(err);
+    return VM_FAULT_NOPAGE;
+}
+
+static const struct vm_operations_struct heartydev_vm_ops = {
+    .fault = heartydev_vm_fault,
+};
+
+/**
+ * @brief Number of bytes queued in the ring
+ *
+ * @param hd the device
+ * @return size_t the number of bytes that can be read
+ */
+static inline size_t ring_used(struct heartydev_device *hd) {
+    return READ_ONCE(hd->ring_head) - READ_ONCE(hd->ring_tail);
+}
+
+/**
+ * @brief Check whether a ring reader may proceed
+ *
+ * @param hd the device
+ * @return bool true if there is data, or the device left ring mode
+ */
+static bool ring_readable(struct heartydev_device *hd) {
+    return ring_used(hd) > 0 ||
+           READ_ONCE(hd->current_store) != HEARTYDEV_STORE_RING;
+}
+
+/**
+ * @brief Check whether a ring writer may proceed
+ *
+ * @param hd the device
+ * @return bool true if there is room, or the device left ring mode
+ */
+static bool ring_writable(struct heartydev_device *hd) {
+    return ring_used(hd) < ring_size ||
+           READ_ONCE(hd->current_store) != HEARTYDEV_STORE_RING;
+}
+
+/**
+ * @brief Take a snapshot of the counters, the buffer length and the
+ *        compressed size of the buffer
+ *
+ * @param hd the device
+ * @param out the snapshot to fill in
+ */
+static void heartydev_get_stats(struct heartydev_device *hd,
+                                struct heartydev_stats *out) {
+    struct heartydev_store *st;
+    int idx;
+
+    stats_sum(hd, out);
+    if (READ_ONCE(hd->current_store) == HEARTYDEV_STORE_RING)
+        out->buf_len = ring_used(hd);
+    else
+        out->buf_len = message_len(hd);
+
+    idx = srcu_read_lock(&message_srcu);
+    st = srcu_dereference(hd->message, &message_srcu);
+    out->compressed_pages = st->nr_zpages;
+    out->compressed_bytes = st->zbytes;
+    srcu_read_unlock(&message_srcu, idx);
+}
+
+/**
+ * @brief Switch the device between the message buffer and the ring
+ *
+ * Entering ring mode starts from an empty ring. The message buffer keeps
+ * its contents while the ring is in use.
+ *
+ * @param hd the device
+ * @param store HEARTYDEV_STORE_BUFFER or HEARTYDEV_STORE_RING
+ * @return int 0 if successful
+ */
+static int heartydev_set_store(struct heartydev_device *hd, int store) {
+    if (store != HEARTYDEV_STORE_BUFFER && store != HEARTYDEV_STORE_RING)
+        return -EINVAL;
+
+    mutex_lock(&hd->ring_lock);
+    if (store == HEARTYDEV_STORE_RING) {
+        if (!hd->ring_data) {
+            hd->ring_data = vmalloc(ring_size);
+            if (!hd->ring_data) {
+                mutex_unlock(&hd->ring_lock);
+                return -ENOMEM;
+            }
+        }
+        hd->ring_head = 0;
+        hd->ring_tail = 0;
+    }
+    WRITE_ONCE(hd->current_store, store);
+    mutex_unlock(&hd->ring_lock);
+
+    /* let sleepers notice that the store they wait on went away */
+    wake_up_interruptible_all(&hd->readq);
+    wake_up_interruptible_all(&hd->writeq);
+    return 0;
+}
+
+/**
+ * @brief Choose whether the device transforms on read or on write
+ *
+ * On write, the mode is applied once as the data comes in and readers get
+ * the stored bytes, so a buffer read many times is only transformed once.
+ * Data that is already stored is left alone. Modes that change the length
+ * of the data cannot be applied on write. A table mode takes the table of
+ * the calling file.
+ *
+ * @param hd the device
+ * @param hf the calling file
+ * @param policy HEARTYDEV_POLICY_ON_READ or HEARTYDEV_POLICY_ON_WRITE
+ * @param mode the mode to apply on write
+ * @return int 0 if successful
+ */
+static int heartydev_set_policy(struct heartydev_device *hd,
+                                struct heartydev_file *hf, int policy,
+                                int mode) {
+    const struct xform_ops *ops = xform_get(mode);
+
+    if (policy != HEARTYDEV_POLICY_ON_READ &&
+        policy != HEARTYDEV_POLICY_ON_WRITE)
+        return -EINVAL;
+    if (policy == HEARTYDEV_POLICY_ON_WRITE && (!ops || ops->ratio != 1))
+        return -EINVAL;
+
+    mutex_lock(&hd->message_lock);
+    mutex_lock(&hd->ring_lock);
+    if (policy == HEARTYDEV_POLICY_ON_WRITE) {
+        hd->write_mode = mode;
+        memcpy(hd->write_lut, hf->lut, sizeof(hd->write_lut));
+    }
+    WRITE_ONCE(hd->policy, policy);
+    mutex_unlock(&hd->ring_lock);
+    mutex_unlock(&hd->message_lock);
+    return 0;
+}
+
+/**
+ * @brief Consume bytes from the ring
+ *
+ * Sleeps while the ring is empty unless the file is non-blocking. Bytes
+ * that need a transform are staged through the per-open scratch page,
+ * under read_lock of the file.
+ * With modes that expand the data, only as many bytes are consumed as
+ * fit into the destination with all of their output.
+ *
+ * @param iocb the I/O control block
+ * @param to the destination
+ * @param mode the mode to read in
+ * @return ssize_t the number of bytes read, or a negative error code
+ */
+static ssize_t ring_read(struct kiocb *iocb, struct iov_iter *to, int mode) {
+    struct heartydev_file *hf = iocb->ki_filp->private_data;
+    struct heartydev_device *hd = hf->dev;
+    char *chunk = hf->scratch;
+    size_t count = iov_iter_count(to);
+    const struct xform_ops *ops = xform_get(mode);
+    unsigned int ratio = ops->ratio;
+    size_t done = 0, avail, pos, len, seg, copied;
+
+    if (count == 0)
+        return 0;
+    /* a queued byte is consumed as a whole, with all of its output */
+    if (count < ratio)
+        return -EINVAL;
+
+    mutex_lock(&hd->ring_lock);
+    while (ring_used(hd) == 0) {
+        mutex_unlock(&hd->ring_lock);
+        if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+            (iocb->ki_flags & IOCB_NOWAIT))
+            return -EAGAIN;
+        if (wait_event_interruptible(hd->readq, ring_readable(hd)))
+            return -ERESTARTSYS;
+        if (READ_ONCE(hd->current_store) != HEARTYDEV_STORE_RING)
+            return 0;
+        mutex_lock(&hd->ring_lock);
+    }
+
+    if (mode != HEARTYDEV_NORMAL)
+        mutex_lock(&hf->read_lock);
+    /* avail and len count queued bytes, done counts output bytes */
+    avail = min(count / ratio, ring_used(hd));
+    while (done < avail * ratio) {
+        pos = hd->ring_tail & (ring_size - 1);
+        len = min_t(size_t, avail - done / ratio, ring_size - pos);
+        if (ops->to_user) {
+            copied = fused_to_iter(to, hd->ring_data + pos, len, ops);
+            hd->ring_tail += copied;
+            done += copied;
+            if (copied)
+                continue;
+        }
+        if (mode != HEARTYDEV_NORMAL) {
+            len = min_t(size_t, len, SCRATCH_SIZE / ratio);
+            seg = iov_iter_single_seg_count(to);
+            if (seg >= ratio)
+                len = min_t(size_t, len, seg / ratio);
+            heartydev_transform(chunk, hd->ring_data + pos, len, mode, hf->lut);
+        }
+        copied = copy_to_iter(mode != HEARTYDEV_NORMAL ? chunk :
+                              hd->ring_data + pos, len * ratio, to);
+        /* a byte whose output got through only in part stays queued */
+        iov_iter_revert(to, copied % ratio);
+        hd->ring_tail += copied / ratio;
+        done += copied - copied % ratio;
+        if (copied < len * ratio)
+            break;
+    }
+    if (mode != HEARTYDEV_NORMAL)
+        mutex_unlock(&hf->read_lock);
+    mutex_unlock(&hd->ring_lock);
+
+    if (done == 0)
+        return stats_error(hd, -EFAULT);
+    stats_read(hd, mode, done);
+    wake_up_interruptible_poll(&hd->writeq, EPOLLOUT | EPOLLWRNORM);
+    return done;
+}
+
+/**
+ * @brief Append bytes to the ring
+ *
+ * Sleeps while the ring is full unless the file is non-blocking. A write
+ * larger than the free space is cut short.
+ *
+ * @param iocb the I/O control block
+ * @param from the source
+ * @param mode set to the mode the bytes are stored in
+ * @return ssize_t the number of bytes written, 0 if the device left ring
+ *         mode while the writer slept, or a negative error code
+ */
+static ssize_t ring_write(struct kiocb *iocb, struct iov_iter *from,
+                          int *mode) {
+    struct heartydev_file *hf = iocb->ki_filp->private_data;
+    struct heartydev_device *hd = hf->dev;
+    size_t count = iov_iter_count(from);
+    size_t done = 0, room, pos, len, copied;
+
+    if (count == 0)
+        return 0;
+
+    mutex_lock(&hd->ring_lock);
+    while (ring_used(hd) == ring_size) {
+        mutex_unlock(&hd->ring_lock);
+        if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+            (iocb->ki_flags & IOCB_NOWAIT))
+            return -EAGAIN;
+        if (wait_event_interruptible(hd->writeq, ring_writable(hd)))
+            return -ERESTARTSYS;
+        if (READ_ONCE(hd->current_store) != HEARTYDEV_STORE_RING)
+            return 0;
+        mutex_lock(&hd->ring_lock);
+    }
+
+    *mode = write_mode(hd);
+    room = min_t(size_t, count, ring_size - ring_used(hd));
+    while (done < room) {
+        pos = hd->ring_head & (ring_size - 1);
+        len = min_t(size_t, room - done, ring_size - pos);
+        if (*mode != HEARTYDEV_NORMAL)
+            copied = transform_from_iter(hd->ring_data + pos, len, from,
+                                         *mode, hd->write_lut);
+        else
+            copied = copy_from_iter(hd->ring_data + pos, len, from);
+        hd->ring_head += copied;
+        done += copied;
+        if (copied < len)
+            break;
+    }
+    mutex_unlock(&hd->ring_lock);
+
+    if (done == 0)
+        return stats_error(hd, -EFAULT);
+    stats_write(hd, done);
+    wake_up_interruptible_poll(&hd->readq, EPOLLIN | EPOLLRDNORM);
+    return done;
+}
+
+/**
+ * @brief Print the rows of latency histograms that have counts
+ *
+ * @param m the seq_file
+ * @param hists the per-CPU histograms, nr in a row
+ * @param nr the number of histograms
+ */
+static void latency_show_hists(struct seq_file *m,
+                               struct heartydev_hist __percpu *hists,
+                               unsigned int nr) {
+    u64 sum[HIST_OPS + 1];
+    unsigned int b, i;
+    bool any;
+    int cpu;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        any = false;
+        for (i = 0; i < nr; i++) {
+            sum[i] = 0;
+            for_each_possible_cpu(cpu)
+                sum[i] += READ_ONCE(per_cpu_ptr(hists, cpu)[i].buckets[b]);
+            any |= sum[i] != 0;
+        }
+        if (!any)
+            continue;
+        if (b == 0)
+            seq_printf(m, "%12u %12u", 0, 1);
+        else if (b == HIST_BUCKETS - 1)
+            seq_printf(m, "%12llu %12s", 1ULL << (b - 1), "-");
+        else
+            seq_printf(m, "%12llu %12llu", 1ULL << (b - 1), 1ULL << b);
+        for (i = 0; i < nr; i++)
+            seq_printf(m, " %12llu", sum[i]);
+        seq_putc(m, '\n');
+    }
+}
+
+/**
+ * @brief Show the latency histograms of a device
+ *
+ * @param m the seq_file, whose private data is the device
+ * @param v unused
+ * @return int 0
+ */
+static int latency_show(struct seq_file *m, void *v) {
+    struct heartydev_device *hd = m->private;
+
+    seq_printf(m, "%12s %12s %12s %12s %12s\n", "from_ns", "to_ns", "read",
+               "write", "ioctl");
+    latency_show_hists(m, &hd->stats->latency[0], HIST_OPS);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+/**
+ * @brief Show the latency histogram of the transform step
+ *
+ * @param m the seq_file
+ * @param v unused
+ * @return int 0
+ */
+static int transform_show(struct seq_file *m, void *v) {
+    seq_printf(m, "%12s %12s %12s\n", "from_ns", "to_ns", "transform");
+    latency_show_hists(m, &transform_hist, 1);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(transform);
+
+/**
+ * @brief Show the current state of a device
+ *
+ * @param m the seq_file, whose private data is the device
+ * @param v unused
+ * @return int 0
+ */
+static int state_show(struct seq_file *m, void *v) {
+    struct heartydev_device *hd = m->private;
+    int store = READ_ONCE(hd->current_store);
+    int policy = READ_ONCE(hd->policy);
+    struct heartydev_stats stats;
+
+    seq_printf(m, "message_len: %zu\n", message_len(hd));
+    seq_printf(m, "capacity: %lu\n", max_buffer_size);
+    seq_printf(m, "store: %s\n",
+               store == HEARTYDEV_STORE_RING ? "ring" : "buffer");
+    seq_printf(m, "ring_used: %zu\n", READ_ONCE(hd->ring_head) -
+               READ_ONCE(hd->ring_tail));
+    seq_printf(m, "ring_size: %lu\n", ring_size);
+    seq_printf(m, "default_mode: %s\n",
+               xform_get(heartydev_default_mode(hd))->name);
+    seq_printf(m, "policy: %s\n",
+               policy == HEARTYDEV_POLICY_ON_WRITE ? "write" : "read");
+    if (policy == HEARTYDEV_POLICY_ON_WRITE)
+        seq_printf(m, "write_mode: %s\n",
+                   xform_get(READ_ONCE(hd->write_mode))->name);
+    seq_printf(m, "claimed: %d\n", atomic_read(&hd->in_use));
+    if (compress) {
+        heartydev_get_stats(hd, &stats);
+        seq_printf(m, "compressed_pages: %llu\n", stats.compressed_pages);
+        seq_printf(m, "compressed_bytes: %llu\n", stats.compressed_bytes);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(state);
+
+/**
+ * @brief Report whether the latency histograms are enabled
+ *
+ * @param file the debugfs file
+ * @param buf the user buffer
+ * @param count the size of the buffer
+ * @param ppos the file position
+ * @return ssize_t the number of bytes read
+ */
+static ssize_t latency_enable_read(struct file *file, char __user *buf,
+                                   size_t count, loff_t *ppos) {
+    char val[2] = { static_key_enabled(&latency_key) ? '1' : '0', '\n' };
+
+    return simple_read_from_buffer(buf, count, ppos, val, sizeof(val));
+}
+
+/**
+ * @brief Enable or disable the latency histograms
+ *
+ * Enabling clears all histograms first, so every enable starts a new
+ * measurement.
+ *
+ * @param file the debugfs file
+ * @param buf "0" or "1", or anything else kstrtobool accepts
+ * @param count the size of the buffer
+ * @param ppos the file position
+ * @return ssize_t count if successful, a negative error code otherwise
+ */
+static ssize_t latency_enable_write(struct file *file, const char __user *buf,
+                                    size_t count, loff_t *ppos) {
+    unsigned int i;
+    bool enable;
+    int cpu, ret;
+
+    ret = kstrtobool_from_user(buf, count, &enable);
+    if (ret)
+        return ret;
+
+    if (!enable) {
+        static_branch_disable(&latency_key);
+        return count;
+    }
+    if (static_key_enabled(&latency_key))
+        return count;
+    for_each_possible_cpu(cpu) {
+        for (i = 0; i < nr_devs; i++)
+            memset(per_cpu_ptr(heartydev_devs[i].stats, cpu)->latency, 0,
+                   sizeof(per_cpu_ptr(heartydev_devs[i].stats, cpu)->latency));
+        memset(per_cpu_ptr(&transform_hist, cpu), 0,
+               sizeof(struct heartydev_hist));
+    }
+    static_branch_enable(&latency_key);
+    return count;
+}
+
+static const struct file_operations latency_enable_fops = {
+    .owner = THIS_MODULE,
+    .read = latency_enable_read,
+    .write = latency_enable_write,
+    .llseek = default_llseek,
+};
+
+/*
+ * sysfs attributes of every minor, under /sys/class/heartydev/<name>/.
+ * Reading them neither opens the device nor touches its counters.
+ */
+
+/**
+ * @brief Show the mode new files of the device start in
+ *
+ * @param dev the device
+ * @param attr the attribute
+ * @param buf the page to print to
+ * @return ssize_t the length of the output
+ */
+static ssize_t mode_show(struct device *dev, struct device_attribute *attr,
+                         char *buf) {
+    struct heartydev_device *hd = dev_get_drvdata(dev);
+
+    return scnprintf(buf, PAGE_SIZE, "%s\n",
+                     xform_get(heartydev_default_mode(hd))->name);
+}
+
+/**
+ * @brief Set the mode new files of the device start in
+ *
+ * Files that are already open keep their mode.
+ *
+ * @param dev the device
+ * @param attr the attribute
+ * @param buf the name or number of a mode
+ * @param count the length of buf
+ * @return ssize_t count if successful, -EINVAL for an unknown mode
+ */
+static ssize_t mode_store(struct device *dev, struct device_attribute *attr,
+                          const char *buf, size_t count) {
+    struct heartydev_device *hd = dev_get_drvdata(dev);
+    int mode;
+
+    if (kstrtoint(buf, 0, &mode)) {
+        for (mode = 0; mode < HEARTYDEV_MAX_MODES; mode++)
+            if (xform_get(mode) && sysfs_streq(buf, xform_get(mode)->name))
+                break;
+    }
+    if (!xform_get(mode))
+        return -EINVAL;
+    WRITE_ONCE(hd->mode, mode);
+    return count;
+}
+static DEVICE_ATTR_RW(mode);
+
+static ssize_t buf_len_show(struct device *dev, struct device_attribute *attr,
+                            char *buf) {
+    return scnprintf(buf, PAGE_SIZE, "%zu\n",
+                     message_len(dev_get_drvdata(dev)));
+}
+static DEVICE_ATTR_RO(buf_len);
+
+static ssize_t capacity_show(struct device *dev, struct device_attribute *attr,
+                             char *buf) {
+    return scnprintf(buf, PAGE_SIZE, "%lu\n", max_buffer_size);
+}
+static DEVICE_ATTR_RO(capacity);
+
+/* one read-only attribute per counter of struct heartydev_stats */
+#define HEARTYDEV_STAT_ATTR(field)                                          \
+static ssize_t field##_show(struct device *dev,                             \
+                            struct device_attribute *attr, char *buf) {     \
+    struct heartydev_stats stats;                                           \
+                                                                            \
+    stats_sum(dev_get_drvdata(dev), &stats);                                \
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", stats.field);               \
+}                                                                           \
+static DEVICE_ATTR_RO(field)
+
+HEARTYDEV_STAT_ATTR(reads);
+HEARTYDEV_STAT_ATTR(writes);
+HEARTYDEV_STAT_ATTR(bytes_in);
+HEARTYDEV_STAT_ATTR(bytes_out);
+HEARTYDEV_STAT_ATTR(errors);
+
+static struct attribute *heartydev_attrs[] = {
+    &dev_attr_mode.attr,
+    &dev_attr_buf_len.attr,
+    &dev_attr_capacity.attr,
+    NULL,
+};
+
+static const struct attribute_group heartydev_group = {
+    .attrs = heartydev_attrs,
+};
+
+static struct attribute *heartydev_stats_attrs[] = {
+    &dev_attr_reads.attr,
+    &dev_attr_writes.attr,
+    &dev_attr_bytes_in.attr,
+    &dev_attr_bytes_out.attr,
+    &dev_attr_errors.attr,
+    NULL,
+};
+
+/* the counters live in a stats/ subdirectory */
+static const struct attribute_group heartydev_stats_group = {
+    .name = "stats",
+    .attrs = heartydev_stats_attrs,
+};
+
+static const struct attribute_group *heartydev_groups[] = {
+    &heartydev_group,
+    &heartydev_stats_group,
+    NULL,
+};
+
+/**
+ * @brief Set up the state of one minor and make it visible
+ *
+ * @param hd the device
+ * @param minor the minor number
+ * @return int 0 if successful, a negative error code otherwise
+ */
+static int heartydev_device_init(struct heartydev_device *hd, unsigned int minor) {
+    struct dentry *dir;
+    int ret = -ENOMEM;
+
+    hd->devt = MKDEV(MAJOR(heartydev_devt), minor);
+    hd->current_store = HEARTYDEV_STORE_BUFFER;
+    hd->mode = -1;
+    mutex_init(&hd->message_lock);
+    init_rwsem(&hd->map_sem);
+    mutex_init(&hd->ring_lock);
+    atomic_set(&hd->in_use, CDEV_NOT_USED);
+    init_waitqueue_head(&hd->readq);
+    init_waitqueue_head(&hd->writeq);
+    spin_lock_init(&hd->async_lock);
+    INIT_LIST_HEAD(&hd->async_list);
+    atomic_set(&hd->async_inflight, 0);
+    init_waitqueue_head(&hd->asyncq);
+
+    RCU_INIT_POINTER(hd->message, store_alloc(0));
+    RCU_INIT_POINTER(hd->rendered, store_alloc(0));
+    hd->stats = alloc_percpu(struct heartydev_pcpu_stats);
+    hd->async_wq = alloc_workqueue("heartydev%u", WQ_UNBOUND, 0, minor);
+    if (!rcu_access_pointer(hd->message) || !rcu_access_pointer(hd->rendered) ||
+        !hd->stats || !hd->async_wq)
+        goto fail;
+    if (compress) {
+        hd->zwork = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        hd->zbounce = kvmalloc(LZ4_COMPRESSBOUND(PAGE_SIZE), GFP_KERNEL);
+        if (!hd->zwork || !hd->zbounce)
+            goto fail;
+    }
+
+    cdev_init(&hd->cdev, &heartydev_fops);
+    hd->cdev.owner = THIS_MODULE;
+    ret = cdev_add(&hd->cdev, hd->devt, 1);
+    if (ret)
+        goto fail;
+
+    /* a lone device keeps its historical name */
+    if (nr_devs == 1)
+        hd->device = device_create_with_groups(heartydev_class, NULL, hd->devt,
+                                               hd, heartydev_groups,
+                                               "heartydev");
+    else
+        hd->device = device_create_with_groups(heartydev_class, NULL, hd->devt,
+                                               hd, heartydev_groups,
+                                               "heartydev%u", minor);
+    if (IS_ERR(hd->device)) {
+        ret = PTR_ERR(hd->device);
+        cdev_del(&hd->cdev);
+        goto fail;
+    }
+
+    /* removed with the whole heartydev directory on unload */
+    dir = debugfs_create_dir(dev_name(hd->device), heartydev_debugfs);
+    debugfs_create_file("latency", 0400, dir, hd, &latency_fops);
+    debugfs_create_file("state", 0400, dir, hd, &state_fops);
+    return 0;
+
+fail:
+    if (hd->async_wq)
+        destroy_workqueue(hd->async_wq);
+    kvfree(hd->zwork);
+    kvfree(hd->zbounce);
+    free_percpu(hd->stats);
+    kvfree(rcu_access_pointer(hd->message));
+    kvfree(rcu_access_pointer(hd->rendered));
+    return ret;
+}
+
+/**
+ * @brief Remove one minor and free its state
+ *
+ * Must only be called once no file of the device is open and all SRCU
+ * callbacks have run.
+ *
+ * @param hd the device
+ */
+static void heartydev_device_destroy(struct heartydev_device *hd) {
+    device_destroy(heartydev_class, hd->devt);
+    cdev_del(&hd->cdev);
+    store_destroy(rcu_dereference_protected(hd->message, 1));
+    store_destroy(rcu_dereference_protected(hd->rendered, 1));
+    vfree(hd->ring_data);
+    destroy_workqueue(hd->async_wq);
+    kvfree(hd->zwork);
+    kvfree(hd->zbounce);
+    free_percpu(hd->stats);
+}
+
+/** 
+ * @brief Initialize the device driver
+ * 
+ * @return int 0 if successful
+ */
+static int __init heartydev_init(void) {
+    unsigned int i;
+    int ret;
+
+    printk(KERN_INFO "----heartydev INIT START----\n");
+    if (nr_devs < 1 || nr_devs > HEARTYDEV_MAX_DEVS) {
+        pr_err("heartydev: nr_devs must be between 1 and %d\n",
+               HEARTYDEV_MAX_DEVS);
+        return -EINVAL;
+    }
+    if (open_policy < OPEN_SHARED || open_policy > OPEN_SINGLE_WRITER) {
+        pr_err("heartydev: open_policy must be 0, 1 or 2\n");
+        return -EINVAL;
+    }
+    max_buffer_size = min(max_buffer_size, HEARTYDEV_MMAP_RENDERED);
+    ring_size = roundup_pow_of_two(max_t(unsigned long, ring_size, PAGE_SIZE));
+
+    heartydev_file_cache = KMEM_CACHE(heartydev_file, SLAB_HWCACHE_ALIGN);
+    if (!heartydev_file_cache)
+        return -ENOMEM;
+    if (pool_pages) {
+        heartydev_page_pool = mempool_create_page_pool(pool_pages, 0);
+        if (!heartydev_page_pool) {
+            pr_err("heartydev: Failed to preallocate %u pages\n", pool_pages);
+            ret = -ENOMEM;
+            goto destroy_cache;
+        }
+    }
+
+    ret = alloc_chrdev_region(&heartydev_devt, 0, nr_devs, "heartydev");
+    if (ret < 0) {
+        printk(KERN_ALERT "heartydev registration failed\n");
+        goto destroy_pool;
+    }
+
+    heartydev_devs = kcalloc(nr_devs, sizeof(*heartydev_devs), GFP_KERNEL);
+    if (!heartydev_devs) {
+        ret = -ENOMEM;
+        goto unregister;
+    }
+
+    /* ********* Kernel Version 5.8.0-63-generic ********* */
+    heartydev_class = class_create(THIS_MODULE, "heartydev");
+    if (IS_ERR(heartydev_class)) {
+        ret = PTR_ERR(heartydev_class);
+        goto free_devs;
+    }
+    heartydev_class->dev_uevent = heartydev_uevent;
+
+    heartydev_debugfs = debugfs_create_dir("heartydev", NULL);
+
+    for (i = 0; i < nr_devs; i++) {
+        ret = heartydev_device_init(&heartydev_devs[i], i);
+        if (ret) {
+            printk(KERN_ALERT "Failed to set up heartydev minor %u\n", i);
+            goto destroy_devs;
+        }
+    }
+    /* the switch clears the histograms of every minor, so it comes last */
+    debugfs_create_file("latency_enable", 0600, heartydev_debugfs, NULL,
+                        &latency_enable_fops);
+    debugfs_create_file("transform", 0400, heartydev_debugfs, NULL,
+                        &transform_fops);
+    printk(KERN_INFO "----heartydev INIT END----\n");
+
+    return 0;
+
+destroy_devs:
+    debugfs_remove_recursive(heartydev_debugfs);
+    while (i--)
+        heartydev_device_destroy(&heartydev_devs[i]);
+    class_destroy(heartydev_class);
+free_devs:
+    kfree(heartydev_devs);
+unregister:
+    unregister_chrdev_region(heartydev_devt, nr_devs);
+destroy_pool:
+    mempool_destroy(heartydev_page_pool);
+destroy_cache:
+    kmem_cache_destroy(heartydev_file_cache);
+    return ret;
+}
+
+/** 
+ * @brief Exit the device driver
+ */
+static void __exit heartydev_exit(void) {
+    unsigned int i;
+
+    printk(KERN_DEBUG "----heartydev memory free----\n");
+    debugfs_remove_recursive(heartydev_debugfs);
+    srcu_barrier(&message_srcu);
+    for (i = 0; i < nr_devs; i++)
+        heartydev_device_destroy(&heartydev_devs[i]);
+    class_destroy(heartydev_class);
+    kfree(heartydev_devs);
+    unregister_chrdev_region(heartydev_devt, nr_devs);
+    mempool_destroy(heartydev_page_pool);
+    kmem_cache_destroy(heartydev_file_cache);
+}
+
+/** 
+ * @brief Open the device driver
+ * 
+ * Under OPEN_EXCLUSIVE, and for writers under OPEN_SINGLE_WRITER, the open
+ * must win the in_use claim of the device and fails with -EBUSY while
+ * another file holds it.
+ *
+ * @param inode the inode
+ * @param file the file
+ * @return int 0 if successful
+ */
+static int heartydev_open(struct inode *inode, struct file *file) {
+    struct heartydev_device *hd = container_of(inode->i_cdev,
+                                               struct heartydev_device, cdev);
+    struct heartydev_file *hf;
+    size_t i;
+    int ret;
+
+    pr_debug("heartydev: open\n");
+
+    hf = kmem_cache_alloc(heartydev_file_cache, GFP_KERNEL);
+    if (!hf)
+        return -ENOMEM;
+    hf->dev = hd;
+    hf->claimed = open_policy == OPEN_EXCLUSIVE ||
+                  (open_policy == OPEN_SINGLE_WRITER &&
+                   (file->f_mode & FMODE_WRITE));
+    if (hf->claimed && atomic_cmpxchg(&hd->in_use, CDEV_NOT_USED,
+                                      CDEV_EXCLUSIVE_OPEN) != CDEV_NOT_USED) {
+        kmem_cache_free(heartydev_file_cache, hf);
+        return -EBUSY;
+    }
+    hf->mode = heartydev_default_mode(hd);
+    for (i = 0; i < ARRAY_SIZE(hf->lut); i++)
+        hf->lut[i] = i;
+    mutex_init(&hf->read_lock);
+    hf->async = false;
+    atomic_set(&hf->async_inflight, 0);
+    hf->async_err = 0;
+    hf->efd = NULL;
+
+    /* scratch page used to transform reads without allocating on the hot path */
+    hf->scratch = (char *)__get_free_page(GFP_KERNEL);
+    hf->zbuf = compress ? (char *)__get_free_page(GFP_KERNEL) : NULL;
+    if (!hf->scratch || (compress && !hf->zbuf)) {
+        ret = -ENOMEM;
+        goto release;
+    }
+    file->private_data = hf;
+
+    /* honor O_TRUNC so that `echo ... > /dev/heartydev` replaces the text */
+    if ((file->f_flags & O_ACCMODE) != O_RDONLY && (file->f_flags & O_TRUNC)) {
+        mutex_lock(&hd->message_lock);
+        ret = store_truncate(hd, &hd->message, 0);
+        mutex_unlock(&hd->message_lock);
+        if (ret)
+            goto release;
+    }
+    return 0;
+
+release:
+    free_page((unsigned long)hf->zbuf);
+    free_page((unsigned long)hf->scratch);
+    if (hf->claimed)
+        atomic_set_release(&hd->in_use, CDEV_NOT_USED);
+    kmem_cache_free(heartydev_file_cache, hf);
+    return ret;
+}
+
+/** 
+ * @brief Release the device driver
+ * 
+ * @param inode the inode
+ * @param file the file
+ * @return int 0 if successful
+ */
+static int heartydev_release(struct inode *inode, struct file *file) {
+    struct heartydev_file *hf = file->private_data;
+    struct heartydev_stats stats;
+
+    stats_sum(hf->dev, &stats);
+    if (hf->claimed)
+        atomic_set_release(&hf->dev->in_use, CDEV_NOT_USED);
+    /* asynchronous writes hold the file, so none is left here */
+    if (hf->efd)
+        eventfd_ctx_put(hf->efd);
+    free_page((unsigned long)hf->zbuf);
+    free_page((unsigned long)hf->scratch);
+    kmem_cache_free(heartydev_file_cache, hf);
+    pr_debug("heartydev: release, total writes: %llu, total reads: %llu\n",
+             stats.writes, stats.reads);
+    return 0;
+}
+
+/**
+ * @brief Carry out an IOCTL command
+ *
+ * Commands that change what the device stores for every file, like
+ * HEARTYDEV_SET_POLICY, HEARTYDEV_SET_STORE and HEARTYDEV_RENDER, fail
+ * with -EBADF on a file that is not open for writing, as a write would,
+ * so a reader cannot change the device behind the back of its writer.
+ *
+ * @param file the file
+ * @param cmd the command
+ * @param arg the argument
+ * @return long 0 if successful
+ */
+static long heartydev_ioctl_cmd(struct file *file, unsigned int cmd,
+                                unsigned long arg)
+{
+    struct heartydev_file *hf = file->private_data;
+    struct heartydev_device *hd = hf->dev;
+    struct heartydev_stats stats;
+    int mode;
+    int store;
+    int len;
+
+    switch (cmd) {
+    case HEARTYDEV_WRITE_CNT:
+        stats_sum(hd, &stats);
+        return min_t(u64, stats.writes, LONG_MAX);
+
+    case HEARTYDEV_READ_CNT:
+        stats_sum(hd, &stats);
+        return min_t(u64, stats.reads, LONG_MAX);
+
+    case HEARTYDEV_BUF_LEN:
+        if (!access_ok((int __user *)arg, sizeof(int))) {
+            pr_err("heartydev: Invalid user space pointer for buffer length\n");
+            return -EFAULT;
+        }
+        if (READ_ONCE(hd->current_store) == HEARTYDEV_STORE_RING)
+            len = ring_used(hd);
+        else
+            len = min_t(size_t, message_len(hd), INT_MAX);
+        if (copy_to_user((int __user *)arg, &len, sizeof(int))) {
+            pr_err("heartydev: Failed to copy buffer length to user space\n");
+            return -EFAULT;
+        }
+        return len;
+    
+    case HEARTYDEV_SET_MODE:
+        if (get_user(mode, (int __user *)arg)) {
+            pr_err("heartydev: Failed to get mode from user space\n");
+            return -EFAULT;
+        }
+
+        if (!xform_get(mode))
+            return -EINVAL;
+
+        WRITE_ONCE(hf->mode, mode);
+        pr_debug("heartydev: mode set to %d\n", mode);
+        return 0;
+
+    case HEARTYDEV_SET_LUT:
+        if (copy_from_user(hf->lut, (void __user *)arg, sizeof(hf->lut))) {
+            pr_err("heartydev: Failed to get lookup table from user space\n");
+            return -EFAULT;
+        }
+        return 0;
+
+    case HEARTYDEV_SET_POLICY: {
+        struct heartydev_policy policy;
+
+        if (!(file->f_mode & FMODE_WRITE))
+            return -EBADF;
+        if (copy_from_user(&policy, (void __user *)arg, sizeof(policy))) {
+            pr_err("heartydev: Failed to get policy from user space\n");
+            return -EFAULT;
+        }
+        return heartydev_set_policy(hd, hf, policy.policy, policy.mode);
+    }
+
+    case HEARTYDEV_SET_STORE:
+        if (!(file->f_mode & FMODE_WRITE))
+            return -EBADF;
+        if (get_user(store, (int __user *)arg)) {
+            pr_err("heartydev: Failed to get store from user space\n");
+            return -EFAULT;
+        }
+        return heartydev_set_store(hd, store);
+
+    case HEARTYDEV_RENDER:
+        if (!(file->f_mode & FMODE_WRITE))
+            return -EBADF;
+        return heartydev_render(hd, read_mode(hf), hf->lut);
+
+    case HEARTYDEV_GET_STATS:
+        heartydev_get_stats(hd, &stats);
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+
+    case HEARTYDEV_BATCH:
+        return heartydev_batch(file, arg);
+
+    case HEARTYDEV_WRITE_BARRIER:
+        if (wait_event_interruptible(hd->asyncq,
+                                     !atomic_read(&hf->async_inflight)))
+            return -ERESTARTSYS;
+        return xchg(&hf->async_err, 0);
+
+    case HEARTYDEV_SET_EVENTFD: {
+        struct eventfd_ctx *efd = NULL, *old;
+        int fd;
+
+        if (get_user(fd, (int __user *)arg)) {
+            pr_err("heartydev: Failed to get eventfd from user space\n");
+            return -EFAULT;
+        }
+        if (fd >= 0) {
+            efd = eventfd_ctx_fdget(fd);
+            if (IS_ERR(efd))
+                return PTR_ERR(efd);
+        }
+        spin_lock(&hd->async_lock);
+        old = hf->efd;
+        hf->efd = efd;
+        spin_unlock(&hd->async_lock);
+        if (old)
+            eventfd_ctx_put(old);
+        return 0;
+    }
+
+    case HEARTYDEV_SET_ASYNC: {
+        int on;
+
+        if (get_user(on, (int __user *)arg)) {
+            pr_err("heartydev: Failed to get async flag from user space\n");
+            return -EFAULT;
+        }
+        WRITE_ONCE(hf->async, on != 0);
+        return 0;
+    }
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/**
+ * @brief IOCTL function for the device driver
+ *
+ * @param file the file
+ * @param cmd the command
+ * @param arg the argument
+ * @return long 0 if successful
+ */
+static long heartydev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct heartydev_file *hf = file->private_data;
+    u64 start = latency_start(trace_heartydev_ioctl_enabled());
+    u64 latency;
+    long ret;
+
+    ret = heartydev_ioctl_cmd(file, cmd, arg);
+    if (!start)
+        return ret;
+    latency = ktime_get_ns() - start;
+    latency_record(hf->dev, HIST_IOCTL, latency);
+    if (trace_heartydev_ioctl_enabled())
+        trace_heartydev_ioctl(cmd, ret, latency);
+
+    return ret;
+}
+
+/**
+ * @brief Read from the message buffer
+ *
+ * Reads start at the position in iocb, so pread() works at any offset. A
+ * read returns as many bytes as are available up to the size of the
+ * destination, and 0 only at the end of the data.
+ *
+ * @param iocb the I/O control block, holding the file position
+ * @param to the destination
+ * @param mode the mode to read in
+ * @return ssize_t the number of bytes read, or a negative error code
+ */
+static ssize_t message_read(struct kiocb *iocb, struct iov_iter *to, int mode) {
+    struct heartydev_file *hf = iocb->ki_filp->private_data;
+    struct heartydev_device *hd = hf->dev;
+    struct heartydev_store *st;
+    size_t count = iov_iter_count(to);
+    size_t len, bytes_to_read, done;
+    loff_t pos = iocb->ki_pos;
+    bool staged = mode != HEARTYDEV_NORMAL || compress;
+    int idx, ret;
+
+    if (count == 0)
+        return 0;
+    if (staged) {
+        ret = read_bufs_lock(hf, iocb);
+        if (ret)
+            return ret;
+    }
+
+    idx = srcu_read_lock(&message_srcu);
+    st = srcu_dereference(hd->message, &message_srcu);
+
+    /* positions count the output of the mode */
+    len = st->len * mode_ratio(mode);
+    if (pos < 0 || pos >= len) {
+        srcu_read_unlock(&message_srcu, idx);
+        if (staged)
+            mutex_unlock(&hf->read_lock);
+        return 0;
+    }
+    bytes_to_read = min_t(size_t, len - pos, count);
+
+    /* NORMAL copies the pages as they are, unpacking compressed ones in zbuf */
+    if (mode == HEARTYDEV_NORMAL)
+        done = store_copy_to_iter(st, to, pos, bytes_to_read, hf->zbuf);
+    else if (READ_ONCE(parallel_threshold) &&
+             bytes_to_read >= READ_ONCE(parallel_threshold))
+        done = parallel_transform_to_iter(st, to, pos, bytes_to_read, mode,
+                                          hf);
+    else
+        done = store_transform_to_iter(st, to, pos, bytes_to_read, mode,
+                                       hf->scratch, hf->zbuf, hf->lut);
+    srcu_read_unlock(&message_srcu, idx);
+    if (staged)
+        mutex_unlock(&hf->read_lock);
+
+    if (done == 0) {
+        pr_err_ratelimited("heartydev: Failed to copy data to user space\n");
+        return stats_error(hd, -EFAULT);
+    }
+
+    iocb->ki_pos += done;
+    stats_read(hd, mode, done);
+
+    return done;
+}
+
+/** 
+ * @brief Read function for the device driver
+ *
+ * Serves read(), readv() and friends. The destination may consist of
+ * several segments, which are filled in order.
+ * 
+ * @param iocb the I/O control block
+ * @param to the destination
+ */
+static ssize_t heartydev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct heartydev_file *hf = iocb->ki_filp->private_data;
+    u64 start = latency_start(trace_heartydev_read_enabled());
+    size_t count = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    int mode = read_mode(hf);
+    u64 latency;
+    ssize_t ret;
+
+    if (READ_ONCE(hf->dev->current_store) == HEARTYDEV_STORE_RING)
+        ret = ring_read(iocb, to, mode);
+    else
+        ret = message_read(iocb, to, mode);
+
+    if (!start)
+        return ret;
+    latency = ktime_get_ns() - start;
+    latency_record(hf->dev, HIST_READ, latency);
+    if (trace_heartydev_read_enabled())
+        trace_heartydev_read(pos, count, ret, mode, latency);
+    return ret;
+}
+
+/**
+ * @brief Write to the message buffer with message_lock held
+ *
+ * The data is stored at the file position, so successive writes on one open
+ * file append and pwrite() overwrites in place. Files opened with O_APPEND
+ * always write at the end of the data. Writes are cut short at
+ * max_buffer_size.
+ *
+ * @param hd the device
+ * @param iocb the I/O control block, holding the file position
+ * @param from the source
+ * @param mode the mode to store the bytes in
+ * @return ssize_t the number of bytes written, or a negative error code
+ */
+static ssize_t message_write_locked(struct heartydev_device *hd,
+                                    struct kiocb *iocb, struct iov_iter *from,
+                                    int mode) {
+    size_t count = iov_iter_count(from);
+    loff_t pos = iocb->ki_pos;
+    size_t written;
+    ssize_t ret;
+
+    lockdep_assert_held(&hd->message_lock);
+
+    /* O_APPEND, resolved under the lock so racing appenders never overlap */
+    if (iocb->ki_flags & IOCB_APPEND)
+        pos = rcu_dereference_protected(hd->message,
+                    lockdep_is_held(&hd->message_lock))->len;
+
+    if (pos < 0)
+        return stats_error(hd, -EINVAL);
+    if (count == 0)
+        return 0;
+    if (pos >= max_buffer_size)
+        return stats_error(hd, -ENOSPC);
+    if (count > max_buffer_size - pos)
+        count = max_buffer_size - pos;
+
+    ret = store_write(hd, from, pos, count, mode, NULL);
+    if (ret < 0)
+        return stats_error(hd, ret);
+    written = ret;
+    stats_write(hd, written);
+
+    iocb->ki_pos = pos + written;
+    wake_up_interruptible_poll(&hd->readq, EPOLLIN | EPOLLRDNORM);
+
+    return written;
+}
+
+/**
+ * @brief Take a slot for an asynchronous write of a device
+ *
+ * @param hd the device
+ * @return true if fewer than async_depth writes were in flight
+ */
+static bool async_reserve(struct heartydev_device *hd) {
+    if (atomic_inc_return(&hd->async_inflight) <= READ_ONCE(async_depth))
+        return true;
+    atomic_dec(&hd->async_inflight);
+    return false;
+}
+
+/**
+ * @brief Give back the slot of an asynchronous write
+ *
+ * @param hd the device
+ */
+static void async_unreserve(struct heartydev_device *hd) {
+    atomic_dec(&hd->async_inflight);
+    wake_up_interruptible_poll(&hd->writeq, EPOLLOUT | EPOLLWRNORM);
+}
+
+/**
+ * @brief Free an asynchronous write
+ *
+ * @param req the write, whose pages are no longer pinned
+ */
+static void async_free(struct heartydev_async *req) {
+    unsigned int i;
+
+    if (req->spages)
+        for (i = 0; i < req->nr_spages; i++)
+            if (req->spages[i])
+                store_page_free(req->spages[i]);
+    kvfree(req->spages);
+    kvfree(req->pages);
+    kfree(req);
+}
+
+/**
+ * @brief Store one asynchronous write in the message buffer
+ *
+ * An O_APPEND write takes its position only now, and a write is cut
+ * short at max_buffer_size. Must be called with message_lock held.
+ *
+ * @param hd the device
+ * @param req the write, fully staged
+ * @return ssize_t the number of bytes stored, or a negative error code
+ */
+static ssize_t async_store(struct heartydev_device *hd,
+                           struct heartydev_async *req) {
+    size_t pos = req->pos, len, off, done, i;
+    struct bio_vec *bvec;
+    struct iov_iter iter;
+    unsigned int nr;
+    ssize_t ret;
+
+    if (req->err)
+        return stats_error(hd, req->err);
+    if (req->append)
+        pos = rcu_dereference_protected(hd->message,
+                    lockdep_is_held(&hd->message_lock))->len;
+    if (pos >= max_buffer_size)
+        return stats_error(hd, -ENOSPC);
+    len = min_t(size_t, req->len, max_buffer_size - pos);
+    nr = DIV_ROUND_UP(req->soff + len, PAGE_SIZE);
+
+    if (pos % PAGE_SIZE == req->soff) {
+        /* bytes cut off at max_buffer_size would show up in mappings */
+        off = (req->soff + len) % PAGE_SIZE;
+        if (len < req->len && off)
+            memset(page_address(req->spages[nr - 1]) + off, 0,
+                   PAGE_SIZE - off);
+        ret = store_write(hd, NULL, pos, len, HEARTYDEV_NORMAL, req->spages);
+        /* the new version owns the pages it took */
+        if (ret > 0)
+            memset(req->spages, 0, nr * sizeof(*req->spages));
+    } else {
+        bvec = kvmalloc_array(nr, sizeof(*bvec), GFP_KERNEL);
+        if (!bvec)
+            return stats_error(hd, -ENOMEM);
+        for (i = 0, off = req->soff, done = 0; i < nr; i++, off = 0) {
+            bvec[i].bv_page = req->spages[i];
+            bvec[i].bv_offset = off;
+            bvec[i].bv_len = min_t(size_t, len - done, PAGE_SIZE - off);
+            done += bvec[i].bv_len;
+        }
+        iov_iter_bvec(&iter, WRITE, bvec, nr, len);
+        /* the chunks already applied the write mode */
+        ret = store_write(hd, &iter, pos, len, HEARTYDEV_NORMAL, NULL);
+        kvfree(bvec);
+    }
+    if (ret < 0)
+        return stats_error(hd, ret);
+    stats_write(hd, ret);
+    wake_up_interruptible_poll(&hd->readq, EPOLLIN | EPOLLRDNORM);
+    return ret;
+}
+
+/**
+ * @brief Store the asynchronous writes at the head of the queue
+ *
+ * Every write that is fully copied and has no unfinished write in front
+ * of it is stored, under message_lock, in the order they were issued.
+ * Whichever chunk finishes last for a write at the head also stores the
+ * copied writes behind it. An error is kept in the file until the next
+ * HEARTYDEV_WRITE_BARRIER, and so is a write cut short at
+ * max_buffer_size, as -ENOSPC.
+ *
+ * @param hd the device
+ */
+static void async_commit(struct heartydev_device *hd) {
+    struct heartydev_async *req, *tmp;
+    struct heartydev_file *hf;
+    LIST_HEAD(done);
+    ssize_t ret;
+
+    mutex_lock(&hd->message_lock);
+    for (;;) {
+        spin_lock(&hd->async_lock);
+        req = list_first_entry_or_null(&hd->async_list,
+                                       struct heartydev_async, node);
+        if (req && req->staged)
+            list_move_tail(&req->node, &done);
+        else
+            req = NULL;
+        spin_unlock(&hd->async_lock);
+        if (!req)
+            break;
+
+        hf = req->file->private_data;
+        ret = async_store(hd, req);
+        if (ret >= 0 && ret < req->len)
+            ret = -ENOSPC;
+        if (ret < 0)
+            cmpxchg(&hf->async_err, 0, (int)ret);
+
+        spin_lock(&hd->async_lock);
+        if (hf->efd)
+            eventfd_signal(hf->efd, 1);
+        spin_unlock(&hd->async_lock);
+        atomic_dec(&hf->async_inflight);
+        async_unreserve(hd);
+    }
+    mutex_unlock(&hd->message_lock);
+    wake_up_all(&hd->asyncq);
+
+    /* the last reference to a file may go here, so outside the lock */
+    list_for_each_entry_safe(req, tmp, &done, node) {
+        fput(req->file);
+        async_free(req);
+    }
+}
+
+/**
+ * @brief Copy one chunk of an asynchronous write
+ *
+ * A chunk covers whole staged pages and allocates them itself, on the
+ * node it runs on.
+ *
+ * @param work the work item of the chunk
+ */
+static void async_copy_work(struct work_struct *work) {
+    struct heartydev_async_chunk *chunk =
+        container_of(work, struct heartydev_async_chunk, work);
+    struct heartydev_async *req = chunk->req;
+    struct heartydev_device *hd =
+        ((struct heartydev_file *)req->file->private_data)->dev;
+    size_t off, soff, n, done = 0;
+    struct page *page, **spage;
+    char *src;
+
+    while (done < chunk->len) {
+        off = req->offset + chunk->start + done;
+        soff = req->soff + chunk->start + done;
+        n = min_t(size_t, chunk->len - done, PAGE_SIZE - off % PAGE_SIZE);
+        n = min_t(size_t, n, PAGE_SIZE - soff % PAGE_SIZE);
+        spage = &req->spages[soff / PAGE_SIZE];
+        if (!*spage) {
+            *spage = store_page_alloc();
+            if (!*spage) {
+                cmpxchg(&req->err, 0, -ENOMEM);
+                break;
+            }
+        }
+        page = req->pages[off / PAGE_SIZE];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+        src = kmap_local_page(page);
+#else
+        src = kmap(page);
+#endif
+        heartydev_transform(page_address(*spage) + soff % PAGE_SIZE,
+                            src + off % PAGE_SIZE, n, req->mode, req->lut);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+        kunmap_local(src);
+#else
+        kunmap(page);
+#endif
+        done += n;
+    }
+    if (!atomic_dec_and_test(&req->pending))
+        return;
+
+    unpin_user_pages(req->pages, req->nr_pages);
+    spin_lock(&hd->async_lock);
+    req->staged = true;
+    spin_unlock(&hd->async_lock);
+    async_commit(hd);
+}
+
+/**
+ * @brief Issue a write of the message buffer asynchronously
+ *
+ * Only writes from a single user buffer are taken. The call returns once
+ * the pages are pinned and the copy is queued, with the file position
+ * already past the data. An O_APPEND write goes to the end of the buffer
+ * as it is when the write is stored, behind any write queued before it,
+ * so its file position is left alone. When async_depth writes are in
+ * flight the caller waits, or gets -EAGAIN if the file is non-blocking.
+ *
+ * @param iocb the I/O control block, holding the file position
+ * @param from the source
+ * @param mode set to the mode the bytes are stored in, if queued
+ * @return ssize_t the number of bytes queued, 0 if the write has to be
+ *         done synchronously, or a negative error code
+ */
+static ssize_t async_write(struct kiocb *iocb, struct iov_iter *from,
+                           int *mode) {
+    struct file *file = iocb->ki_filp;
+    struct heartydev_file *hf = file->private_data;
+    struct heartydev_device *hd = hf->dev;
+    size_t count = iov_iter_count(from), seg, len, at, start, end, i;
+    bool append = iocb->ki_flags & IOCB_APPEND;
+    loff_t pos = iocb->ki_pos;
+    struct heartydev_async *req;
+    unsigned int nr_chunks;
+    void __user *base;
+    int pinned;
+
+    base = iter_user_seg(from, &seg);
+    if (!base || seg < count)
+        return 0;
+    if (!append) {
+        if (pos < 0)
+            return stats_error(hd, -EINVAL);
+        if (pos >= max_buffer_size)
+            return stats_error(hd, -ENOSPC);
+        count = min_t(size_t, count, max_buffer_size - pos);
+    }
+
+    if (!async_reserve(hd)) {
+        if ((file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+            return -EAGAIN;
+        if (wait_event_interruptible(hd->writeq, async_reserve(hd)))
+            return -ERESTARTSYS;
+    }
+
+    /* the staged copy may start within a page, and so need one more */
+    nr_chunks = DIV_ROUND_UP(count, ASYNC_CHUNK) + 1;
+    req = kzalloc(struct_size(req, chunks, nr_chunks), GFP_KERNEL);
+    if (!req)
+        goto unreserve;
+    req->offset = offset_in_page(base);
+    req->nr_pages = DIV_ROUND_UP(req->offset + count, PAGE_SIZE);
+    req->pages = kvmalloc_array(req->nr_pages, sizeof(*req->pages),
+                                GFP_KERNEL);
+    req->spages = kvcalloc(DIV_ROUND_UP(count, PAGE_SIZE) + 1,
+                           sizeof(*req->spages), GFP_KERNEL);
+    if (!req->pages || !req->spages)
+        goto free;
+
+    /* a buffer that cannot be pinned fails or faults in the regular path */
+    pinned = pin_user_pages_fast((unsigned long)base & PAGE_MASK,
+                                 req->nr_pages, 0, req->pages);
+    if (pinned != req->nr_pages) {
+        if (pinned > 0)
+            unpin_user_pages(req->pages, pinned);
+        goto free;
+    }
+
+    /* ring_lock is enough to see the policy stable, and is rarely held */
+    mutex_lock(&hd->ring_lock);
+    *mode = req->mode = write_mode(hd);
+    memcpy(req->lut, hd->write_lut, sizeof(req->lut));
+    mutex_unlock(&hd->ring_lock);
+
+    req->file = get_file(file);
+    req->pos = pos;
+    req->append = append;
+    req->len = count;
+    atomic_inc(&hf->async_inflight);
+
+    /* an append is expected to land behind the data and the queued writes */
+    len = message_len(hd);
+    spin_lock(&hd->async_lock);
+    if (list_empty(&hd->async_list))
+        hd->async_end = len;
+    at = append ? hd->async_end : (size_t)pos;
+    hd->async_end = max(hd->async_end, at + count);
+    list_add_tail(&req->node, &hd->async_list);
+    spin_unlock(&hd->async_lock);
+
+    /* chunks start on ASYNC_CHUNK boundaries of the staged copy */
+    req->soff = at % PAGE_SIZE;
+    req->nr_spages = DIV_ROUND_UP(req->soff + count, PAGE_SIZE);
+    req->nr_chunks = DIV_ROUND_UP(req->soff + count, ASYNC_CHUNK);
+    atomic_set(&req->pending, req->nr_chunks);
+    for (i = 0; i < req->nr_chunks; i++) {
+        start = max_t(size_t, i * ASYNC_CHUNK, req->soff) - req->soff;
+        end = min_t(size_t, (i + 1) * ASYNC_CHUNK, req->soff + count) -
+              req->soff;
+        req->chunks[i].req = req;
+        req->chunks[i].start = start;
+        req->chunks[i].len = end - start;
+        INIT_WORK(&req->chunks[i].work, async_copy_work);
+        queue_work(hd->async_wq, &req->chunks[i].work);
+    }
+
+    iov_iter_advance(from, count);
+    if (!append)
+        iocb->ki_pos = pos + count;
+    return count;
+
+free:
+    async_free(req);
+unreserve:
+    async_unreserve(hd);
+    return 0;
+}
+
+/**
+ * @brief Wait until the asynchronous writes of a file are stored
+ *
+ * @param hf the file
+ * @return int 0, or -ERESTARTSYS if interrupted
+ */
+static int async_wait(struct heartydev_file *hf) {
+    if (wait_event_interruptible(hf->dev->asyncq,
+                                 !atomic_read(&hf->async_inflight)))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+/**
+ * @brief Write to the message buffer
+ *
+ * Writes of at least async_threshold bytes are stored asynchronously if
+ * the file asked for it with HEARTYDEV_SET_ASYNC, and never otherwise. A
+ * synchronous write waits until the asynchronous writes of its file are
+ * stored, so the writes of one file are stored in the order they were
+ * issued.
+ *
+ * @param iocb the I/O control block, holding the file position
+ * @param from the source
+ * @param mode set to the mode the bytes are stored in
+ * @return ssize_t the number of bytes written, or a negative error code
+ */
+static ssize_t message_write(struct kiocb *iocb, struct iov_iter *from,
+                             int *mode) {
+    struct heartydev_file *hf = iocb->ki_filp->private_data;
+    struct heartydev_device *hd = hf->dev;
+    size_t count = iov_iter_count(from);
+    ssize_t ret;
+
+    if (READ_ONCE(hf->async) && count &&
+        count >= READ_ONCE(async_threshold)) {
+        ret = async_write(iocb, from, mode);
+        if (ret)
+            return ret;
+    }
+    ret = async_wait(hf);
+    if (ret)
+        return ret;
+
+    mutex_lock(&hd->message_lock);
+    *mode = write_mode(hd);
+    ret = message_write_locked(hd, iocb, from, *mode);
+    mutex_unlock(&hd->message_lock);
+
+    return ret;
+}
+
+/** 
+ * @brief Write function for the device driver
+ *
+ * Serves write(), writev() and friends, so a header and a payload can be
+ * stored with one call.
+ * 
+ * @param iocb the I/O control block
+ * @param from the source
+ * @return ssize_t the number of bytes written, or a negative error code
+ */
+static ssize_t heartydev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct heartydev_file *hf = iocb->ki_filp->private_data;
+    u64 start = latency_start(trace_heartydev_write_enabled());
+    size_t count = iov_iter_count(from);
+    loff_t pos = iocb->ki_pos;
+    int mode = HEARTYDEV_NORMAL;
+    u64 latency;
+    ssize_t ret;
+
+    /* a ring writer that slept through a switch of the store starts over */
+    do {
+        if (READ_ONCE(hf->dev->current_store) == HEARTYDEV_STORE_RING)
+            ret = ring_write(iocb, from, &mode);
+        else
+            ret = message_write(iocb, from, &mode);
+    } while (ret == 0 && iov_iter_count(from));
+
+    if (!start)
+        return ret;
+    latency = ktime_get_ns() - start;
+    latency_record(hf->dev, HIST_WRITE, latency);
+    if (trace_heartydev_write_enabled())
+        trace_heartydev_write(pos, count, ret, mode, latency);
+    return ret;
+}
+
+/**
+ * @brief Llseek function for the device driver
+ *
+ * With the message buffer SEEK_END is relative to the end of the data,
+ * positions up to max_buffer_size are allowed, and the whole buffer counts
+ * as data for SEEK_DATA and SEEK_HOLE. In modes that expand the data, such
+ * as HEARTYDEV_HEX, sizes are those of the output, like for reads. The ring
+ * has no position: only SEEK_DATA and SEEK_HOLE at offset 0 are supported,
+ * and they tell whether any bytes are queued (SEEK_DATA fails with ENXIO
+ * when the ring is empty) and how many (the offset returned by SEEK_HOLE),
+ * without consuming them.
+ *
+ * @param file the file
+ * @param offset the offset
+ * @param whence SEEK_SET, SEEK_CUR, SEEK_END, SEEK_DATA or SEEK_HOLE
+ * @return loff_t the resulting offset, or a negative error code
+ */
+static loff_t heartydev_llseek(struct file *file, loff_t offset, int whence) {
+    struct heartydev_file *hf = file->private_data;
+    struct heartydev_device *hd = hf->dev;
+    unsigned int ratio = mode_ratio(read_mode(hf));
+    size_t used;
+
+    if (READ_ONCE(hd->current_store) != HEARTYDEV_STORE_RING)
+        return generic_file_llseek_size(file, offset, whence,
+                                        max_buffer_size * ratio,
+                                        message_len(hd) * ratio);
+
+    if ((whence != SEEK_DATA && whence != SEEK_HOLE) || offset != 0)
+        return -ESPIPE;
+    used = ring_used(hd);
+    if (whence == SEEK_DATA)
+        return used ? 0 : -ENXIO;
+    return used;
+}
+
+/**
+ * @brief Run one operation of a HEARTYDEV_BATCH
+ *
+ * Must be called with message_lock held.
+ *
+ * @param file the file
+ * @param op the operation
+ * @return long the result of the operation
+ */
+static long heartydev_batch_op(struct file *file, struct heartydev_op *op) {
+    struct heartydev_file *hf = file->private_data;
+    struct heartydev_device *hd = hf->dev;
+    void __user *addr = u64_to_user_ptr(op->addr);
+    struct heartydev_stats stats;
+    struct heartydev_store *st;
+    struct kiocb kiocb;
+    struct iov_iter iter;
+    struct iovec iov;
+    long ret;
+
+    switch (op->opcode) {
+    case HEARTYDEV_OP_WRITE:
+    case HEARTYDEV_OP_READ:
+        if (op->flags || op->offset < 0 || op->len > MAX_RW_COUNT)
+            return -EINVAL;
+        if (!(file->f_mode & (op->opcode == HEARTYDEV_OP_WRITE ?
+                              FMODE_WRITE : FMODE_READ)))
+            return -EBADF;
+        ret = import_single_range(op->opcode == HEARTYDEV_OP_WRITE ?
+                                  WRITE : READ, addr, op->len, &iov, &iter);
+        if (ret)
+            return ret;
+        init_sync_kiocb(&kiocb, file);
+        kiocb.ki_pos = op->offset;
+        if (op->opcode == HEARTYDEV_OP_WRITE)
+            return message_write_locked(hd, &kiocb, &iter, write_mode(hd));
+        return message_read(&kiocb, &iter, read_mode(hf));
+
+    case HEARTYDEV_OP_SET_MODE:
+        if (op->flags || op->len >= HEARTYDEV_MAX_MODES || !xform_get(op->len))
+            return -EINVAL;
+        WRITE_ONCE(hf->mode, op->len);
+        return 0;
+
+    case HEARTYDEV_OP_GET_STATS:
+        if (op->flags)
+            return -EINVAL;
+        stats_sum(hd, &stats);
+        st = rcu_dereference_protected(hd->message,
+                                       lockdep_is_held(&hd->message_lock));
+        stats.buf_len = st->len;
+        stats.compressed_pages = st->nr_zpages;
+        stats.compressed_bytes = st->zbytes;
+        if (copy_to_user(addr, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+
+    default:
+        return -EINVAL;
+    }
+}
+
+/**
+ * @brief Run the operations of a HEARTYDEV_BATCH in order
+ *
+ * All operations run under one acquisition of message_lock, so no other
+ * writer gets in between them. The result of each operation is stored in
+ * its descriptor. The batch stops at the first operation that fails. Like
+ * a write, the batch runs only after the asynchronous writes of the file
+ * are stored.
+ *
+ * @param file the file
+ * @param arg the user pointer to the struct heartydev_batch
+ * @return long the number of operations that succeeded, or a negative
+ *         error code if none could be run
+ */
+static long heartydev_batch(struct file *file, unsigned long arg) {
+    struct heartydev_file *hf = file->private_data;
+    struct heartydev_device *hd = hf->dev;
+    struct heartydev_batch batch;
+    struct heartydev_op __user *uops;
+    struct heartydev_op op;
+    long ret = 0;
+    __u32 i;
+
+    if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+        return -EFAULT;
+    if (batch.flags || batch.nr > HEARTYDEV_BATCH_MAX)
+        return -EINVAL;
+    if (READ_ONCE(hd->current_store) == HEARTYDEV_STORE_RING)
+        return -EOPNOTSUPP;
+    uops = u64_to_user_ptr(batch.ops);
+
+    /* storing them takes message_lock, so wait before taking it */
+    ret = async_wait(hf);
+    if (ret)
+        return ret;
+
+    mutex_lock(&hd->message_lock);
+    for (i = 0; i < batch.nr; i++) {
+        if (copy_from_user(&op, &uops[i], sizeof(op))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = heartydev_batch_op(file, &op);
+        if (put_user((__s64)ret, &uops[i].result)) {
+            ret = -EFAULT;
+            break;
+        }
+        if (ret < 0)
+            break;
+    }
+    mutex_unlock(&hd->message_lock);
+
+    /* report an error only if it kept the first operation from running */
+    return (i == 0 && ret < 0) ? ret : i;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/**
+ * @brief io_uring passthrough function for the device driver
+ *
+ * Every command completes inline: the return value is posted as the
+ * completion right away, without a trip through a worker. Only a read of
+ * an empty ring would sleep; on the non-blocking first attempt it returns
+ * -EAGAIN so that io_uring retries it from a worker thread. The payload
+ * lives in the SQE, which user space can still change, so every field is
+ * read once.
+ *
+ * @param ioucmd the command
+ * @param issue_flags the IO_URING_F_* flags of this attempt
+ * @return int the result of the command
+ */
+static int heartydev_uring_cmd(struct io_uring_cmd *ioucmd,
+                               unsigned int issue_flags) {
+    const struct heartydev_uring_cmd *pdu = ioucmd->cmd;
+    struct file *file = ioucmd->file;
+    struct heartydev_file *hf = file->private_data;
+    struct heartydev_stats stats;
+    struct kiocb kiocb;
+    struct iov_iter iter;
+    struct iovec iov;
+    __u64 addr = READ_ONCE(pdu->addr);
+    __u32 len = READ_ONCE(pdu->len);
+    __u32 arg = READ_ONCE(pdu->arg);
+    int ret;
+
+    switch (ioucmd->cmd_op) {
+    case HEARTYDEV_SET_MODE:
+        if (arg >= HEARTYDEV_MAX_MODES || !xform_get(arg))
+            return -EINVAL;
+        WRITE_ONCE(hf->mode, arg);
+        return 0;
+
+    case HEARTYDEV_GET_STATS:
+        heartydev_get_stats(hf->dev, &stats);
+        if (copy_to_user(u64_to_user_ptr(addr), &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+
+    case HEARTYDEV_URING_READ:
+        if (!(file->f_mode & FMODE_READ))
+            return -EBADF;
+        ret = import_single_range(READ, u64_to_user_ptr(addr),
+                                  min_t(size_t, len, MAX_RW_COUNT), &iov, &iter);
+        if (ret)
+            return ret;
+        init_sync_kiocb(&kiocb, file);
+        kiocb.ki_pos = arg;
+        if (issue_flags & IO_URING_F_NONBLOCK)
+            kiocb.ki_flags |= IOCB_NOWAIT;
+        return heartydev_read_iter(&kiocb, &iter);
+
+    default:
+        return -ENOTTY;
+    }
+}
+#endif
+
+/* pipe buffers only hold a page reference, whoever owns the page */
+static const struct pipe_buf_operations heartydev_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get = generic_pipe_buf_get,
+};
+
+/**
+ * @brief Drop a page that splice_to_pipe() did not consume
+ *
+ * @param spd the splice descriptor
+ * @param i the index of the page
+ */
+static void heartydev_spd_release(struct splice_pipe_desc *spd, unsigned int i) {
+    put_page(spd->pages[i]);
+}
+
+/**
+ * @brief Splice function for the device driver
+ *
+ * In NORMAL mode the pages of the current version are handed to the pipe
+ * by reference, so data moves to a socket or file without being copied.
+ * A version never changes below its length, so the pipe keeps seeing the
+ * bytes it was given even if the buffer is rewritten meanwhile. Other
+ * modes hand over the pages of the cached view the same way, or, if there
+ * is none, transform each page into a fresh page owned by the pipe, which
+ * is also where compressed pages are unpacked. The ring is consumed
+ * through the regular read path.
+ *
+ * @param in the file
+ * @param ppos the file position
+ * @param pipe the pipe
+ * @param len the maximum number of bytes to splice
+ * @param flags the splice flags
+ * @return ssize_t the number of bytes spliced, or a negative error code
+ */
+static ssize_t heartydev_splice_read(struct file *in, loff_t *ppos,
+                                     struct pipe_inode_info *pipe, size_t len,
+                                     unsigned int flags) {
+    struct heartydev_file *hf = in->private_data;
+    struct heartydev_device *hd = hf->dev;
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+        .ops = &heartydev_pipe_buf_ops,
+        .spd_release = heartydev_spd_release,
+    };
+    int mode = read_mode(hf);
+    struct heartydev_store *st;
+    struct page *page;
+    size_t pos, off, chunk;
+    ssize_t ret;
+    int idx;
+
+    /* the ring and modes that expand the data go through read_iter */
+    if (READ_ONCE(hd->current_store) == HEARTYDEV_STORE_RING ||
+        mode_ratio(mode) != 1)
+        return generic_file_splice_read(in, ppos, pipe, len, flags);
+    if (*ppos < 0)
+        return -EINVAL;
+
+    idx = srcu_read_lock(&message_srcu);
+    st = srcu_dereference(hd->message, &message_srcu);
+    pos = *ppos;
+    if (pos >= st->len) {
+        srcu_read_unlock(&message_srcu, idx);
+        return 0;
+    }
+    len = min_t(size_t, len, st->len - pos);
+
+    while (len && spd.nr_pages < spd.nr_pages_max) {
+        off = pos % PAGE_SIZE;
+        chunk = min_t(size_t, len, PAGE_SIZE - off);
+        page = st->pages[pos / PAGE_SIZE];
+        if (mode != HEARTYDEV_NORMAL)
+            page = store_view_page(st, mode, pos / PAGE_SIZE);
+        if (page) {
+            get_page(page);
+        } else {
+            page = alloc_page(GFP_KERNEL);
+            if (!page)
+                break;
+            heartydev_transform(page_address(page) + off,
+                                store_page_data(st, pos / PAGE_SIZE,
+                                                page_address(page),
+                                                off + chunk) + off,
+                                chunk, mode, hf->lut);
+        }
+        pages[spd.nr_pages] = page;
+        partial[spd.nr_pages].offset = off;
+        partial[spd.nr_pages].len = chunk;
+        spd.nr_pages++;
+        pos += chunk;
+        len -= chunk;
+    }
+    srcu_read_unlock(&message_srcu, idx);
+
+    if (spd.nr_pages == 0)
+        return stats_error(hd, -ENOMEM);
+
+    ret = splice_to_pipe(pipe, &spd);
+    if (ret > 0) {
+        *ppos += ret;
+        stats_read(hd, mode, ret);
+    }
+    return ret;
+}
+
+/**
+ * @brief Poll function for the device driver
+ *
+ * In ring mode the device is readable while bytes are queued and writable
+ * while there is room. With the message buffer it is readable while the
+ * file position is short of the end of the data, and writable while it is
+ * short of max_buffer_size.
+ *
+ * @param file the file
+ * @param wait the poll table
+ * @return __poll_t the readiness mask
+ */
+static __poll_t heartydev_poll(struct file *file, poll_table *wait) {
+    struct heartydev_file *hf = file->private_data;
+    struct heartydev_device *hd = hf->dev;
+    __poll_t mask = 0;
+    loff_t pos = READ_ONCE(file->f_pos);
+
+    poll_wait(file, &hd->readq, wait);
+    poll_wait(file, &hd->writeq, wait);
+
+    if (READ_ONCE(hd->current_store) == HEARTYDEV_STORE_RING) {
+        if (ring_used(hd) > 0)
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (ring_used(hd) < ring_size)
+            mask |= EPOLLOUT | EPOLLWRNORM;
+    } else {
+        if (pos < message_len(hd) * mode_ratio(read_mode(hf)))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (pos < max_buffer_size &&
+            (!READ_ONCE(hf->async) ||
+             atomic_read(&hd->async_inflight) < READ_ONCE(async_depth)))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+/**
+ * @brief Mmap function for the device driver
+ *
+ * Maps either the message buffer or its rendered copy, read-only. Pages
+ * are faulted in on first access and the mapping only covers written data.
+ *
+ * @param file the file
+ * @param vma the virtual memory area
+ * @return int 0 if successful
+ */
+static int heartydev_mmap(struct file *file, struct vm_area_struct *vma) {
+    const pgoff_t rendered_pgoff = HEARTYDEV_MMAP_RENDERED >> PAGE_SHIFT;
+    struct heartydev_file *hf = file->private_data;
+    struct heartydev_device *hd = hf->dev;
+    struct address_space *mapping;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    /* compressed pages of the message buffer have no page to map */
+    if (compress && vma->vm_pgoff < rendered_pgoff)
+        return -EOPNOTSUPP;
+
+    /* writes tear down stale pages through this mapping; only one is tracked */
+    mapping = cmpxchg(&hd->mapping, NULL, file->f_mapping);
+    if (mapping && mapping != file->f_mapping)
+        return -EBUSY;
+
+    if (vma->vm_pgoff >= rendered_pgoff)
+        vma->vm_private_data = &hd->rendered;
+    else if (vma->vm_pgoff + vma_pages(vma) <= rendered_pgoff)
+        vma->vm_private_data = &hd->message;
+    else
+        return -EINVAL;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &heartydev_vm_ops;
+    return 0;
 }
 
 module_init(heartydev_init);
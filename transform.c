@@ -0,0 +1,698 @@
+/**
+ * @file transform.c
+ * @brief Transform kernels for the heartydev driver.
+ *
+ * Spans are converted 8 bytes at a time with SWAR (SIMD within a register)
+ * arithmetic on every architecture where the transform allows it. On x86,
+ * spans of at least XFORM_SIMD_THRESHOLD bytes use AVX2, SSSE3 or SSE2
+ * between kernel_fpu_begin() and kernel_fpu_end(); below that, saving the
+ * FPU state costs more than it saves.
+ */
+
+#include <linux/kernel.h>   // for min_t
+#include <linux/string.h>   // for memcpy
+#include <linux/types.h>    // for u64
+#include <linux/uaccess.h>  // for user_access_begin and unsafe_get_user
+#include <asm/unaligned.h>  // for get_unaligned and put_unaligned
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h> // for static_cpu_has
+#include <asm/fpu/api.h>    // for kernel_fpu_begin and kernel_fpu_end
+#include <asm/simd.h>       // for may_use_simd
+#endif
+
+#include "heartydev.h"
+#include "transform.h"
+
+#define XFORM_SIMD_THRESHOLD 512
+
+#define ONES 0x0101010101010101ULL
+
+/**
+ * @brief Find the bytes of a word that lie in [lo, hi]
+ *
+ * Adding (0x80 - lo) to a 7-bit byte sets its top bit exactly when the byte
+ * is >= lo, and adding (0x7f - hi) sets it exactly when the byte is > hi.
+ * No addition carries into the next byte because the top bits are cleared
+ * first; bytes that had their top bit set are excluded at the end.
+ *
+ * @param w the word
+ * @param lo the first byte of the range, below 0x80
+ * @param hi the last byte of the range, below 0x80
+ * @return u64 0x80 in every byte that is in the range, 0 elsewhere
+ */
+static __always_inline u64 swar_range(u64 w, u8 lo, u8 hi) {
+    u64 heptets = w & (0x7f * ONES);
+    u64 ge_lo = heptets + (0x80 - lo) * ONES;
+    u64 gt_hi = heptets + (0x7f - hi) * ONES;
+
+    return ge_lo & ~gt_hi & ~w & (0x80 * ONES);
+}
+
+/**
+ * @brief Flip the case bit of every byte of a word that lies in [lo, hi]
+ *
+ * @param w the word
+ * @param lo the first byte to flip
+ * @param hi the last byte to flip
+ * @return u64 the converted word
+ */
+static __always_inline u64 swar_flip_range(u64 w, u8 lo, u8 hi) {
+    return w ^ (swar_range(w, lo, hi) >> 2);
+}
+
+/**
+ * @brief Convert a span word by word, finishing with a byte loop
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param lo the first byte to flip
+ * @param hi the last byte to flip
+ */
+static void swar_case(char *dst, const char *src, size_t len, u8 lo, u8 hi) {
+    size_t i = 0;
+
+    for (; i + sizeof(u64) <= len; i += sizeof(u64))
+        put_unaligned(swar_flip_range(get_unaligned((const u64 *)(src + i)),
+                                      lo, hi),
+                      (u64 *)(dst + i));
+
+    for (; i < len; i++)
+        dst[i] = ((u8)src[i] >= lo && (u8)src[i] <= hi) ? src[i] ^ 0x20 : src[i];
+}
+
+#ifdef CONFIG_X86
+/*
+ * Constants for the vector kernels. A byte b is in [lo, lo + 25] exactly
+ * when b + (0x80 - lo), as a signed byte, is less than -128 + 26.
+ */
+struct simd_case_consts {
+    u8 bias[32];
+    u8 limit[32];
+    u8 flip[32];
+} __aligned(32);
+
+static const struct simd_case_consts upper_consts = {
+    .bias = { [0 ... 31] = 0x80 - 'a' },
+    .limit = { [0 ... 31] = 0x80 + 26 },
+    .flip = { [0 ... 31] = 0x20 },
+};
+
+static const struct simd_case_consts lower_consts = {
+    .bias = { [0 ... 31] = 0x80 - 'A' },
+    .limit = { [0 ... 31] = 0x80 + 26 },
+    .flip = { [0 ... 31] = 0x20 },
+};
+
+/**
+ * @brief Convert the 32-byte blocks of a span with AVX2
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param c the constants for the conversion
+ * @return size_t the number of bytes converted
+ */
+static size_t avx2_case(char *dst, const char *src, size_t len,
+                        const struct simd_case_consts *c) {
+    size_t i;
+
+    asm volatile("vmovdqa %0, %%ymm1" : : "m" (c->bias));
+    asm volatile("vmovdqa %0, %%ymm2" : : "m" (c->limit));
+    asm volatile("vmovdqa %0, %%ymm4" : : "m" (c->flip));
+
+    for (i = 0; i + 32 <= len; i += 32)
+        asm volatile("vmovdqu %1, %%ymm0\n\t"
+                     "vpaddb %%ymm1, %%ymm0, %%ymm3\n\t"
+                     "vpcmpgtb %%ymm3, %%ymm2, %%ymm3\n\t"
+                     "vpand %%ymm4, %%ymm3, %%ymm3\n\t"
+                     "vpxor %%ymm3, %%ymm0, %%ymm0\n\t"
+                     "vmovdqu %%ymm0, %0"
+                     : "=m" (*(u8 (*)[32])(dst + i))
+                     : "m" (*(const u8 (*)[32])(src + i)));
+
+    asm volatile("vzeroupper");
+    return i;
+}
+
+/**
+ * @brief Convert the 16-byte blocks of a span with SSE2
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param c the constants for the conversion
+ * @return size_t the number of bytes converted
+ */
+static size_t sse2_case(char *dst, const char *src, size_t len,
+                        const struct simd_case_consts *c) {
+    size_t i;
+
+    asm volatile("movdqa %0, %%xmm1" : : "m" (c->bias));
+    asm volatile("movdqa %0, %%xmm2" : : "m" (c->limit));
+    asm volatile("movdqa %0, %%xmm4" : : "m" (c->flip));
+
+    for (i = 0; i + 16 <= len; i += 16)
+        asm volatile("movdqu %1, %%xmm0\n\t"
+                     "movdqa %%xmm0, %%xmm3\n\t"
+                     "paddb %%xmm1, %%xmm3\n\t"
+                     "movdqa %%xmm2, %%xmm5\n\t"
+                     "pcmpgtb %%xmm3, %%xmm5\n\t"
+                     "pand %%xmm4, %%xmm5\n\t"
+                     "pxor %%xmm5, %%xmm0\n\t"
+                     "movdqu %%xmm0, %0"
+                     : "=m" (*(u8 (*)[16])(dst + i))
+                     : "m" (*(const u8 (*)[16])(src + i)));
+
+    return i;
+}
+
+/**
+ * @brief Convert as much of a span as possible with vector instructions
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param c the constants for the conversion
+ * @return size_t the number of bytes converted, 0 if SIMD was not used
+ */
+static size_t simd_case(char *dst, const char *src, size_t len,
+                        const struct simd_case_consts *c) {
+    size_t done;
+
+    if (len < XFORM_SIMD_THRESHOLD || !may_use_simd())
+        return 0;
+
+    if (static_cpu_has(X86_FEATURE_AVX2) && static_cpu_has(X86_FEATURE_AVX)) {
+        kernel_fpu_begin();
+        done = avx2_case(dst, src, len, c);
+        kernel_fpu_end();
+    } else if (static_cpu_has(X86_FEATURE_XMM2)) {
+        kernel_fpu_begin();
+        done = sse2_case(dst, src, len, c);
+        kernel_fpu_end();
+    } else {
+        done = 0;
+    }
+
+    return done;
+}
+#endif
+
+/**
+ * @brief Convert lowercase English letters to uppercase
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param table unused
+ */
+static void xform_upper(char *dst, const char *src, size_t len,
+                        const u8 *table) {
+    size_t done = 0;
+
+#ifdef CONFIG_X86
+    done = simd_case(dst, src, len, &upper_consts);
+#endif
+    swar_case(dst + done, src + done, len - done, 'a', 'z');
+}
+
+/**
+ * @brief Convert uppercase English letters to lowercase
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param table unused
+ */
+static void xform_lower(char *dst, const char *src, size_t len,
+                        const u8 *table) {
+    size_t done = 0;
+
+#ifdef CONFIG_X86
+    done = simd_case(dst, src, len, &lower_consts);
+#endif
+    swar_case(dst + done, src + done, len - done, 'A', 'Z');
+}
+
+/**
+ * @brief Copy bytes unchanged
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param table unused
+ */
+static void xform_copy(char *dst, const char *src, size_t len,
+                       const u8 *table) {
+    if (dst != src)
+        memcpy(dst, src, len);
+}
+
+/**
+ * @brief Rotate the English letters of a word by 13 places
+ *
+ * Letters in the first half of the alphabet move up by 13 and the others
+ * down by 13. Neither step leaves the range of a 7-bit byte, so no byte
+ * carries or borrows into its neighbour.
+ *
+ * @param w the word
+ * @return u64 the converted word
+ */
+static __always_inline u64 swar_rot13(u64 w) {
+    u64 up = swar_range(w, 'a', 'm') | swar_range(w, 'A', 'M');
+    u64 down = swar_range(w, 'n', 'z') | swar_range(w, 'N', 'Z');
+
+    return w + (up >> 7) * 13 - (down >> 7) * 13;
+}
+
+/**
+ * @brief Rotate English letters by 13 places
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param table unused
+ */
+static void xform_rot13(char *dst, const char *src, size_t len,
+                        const u8 *table) {
+    size_t i = 0;
+    u8 c;
+
+    for (; i + sizeof(u64) <= len; i += sizeof(u64))
+        put_unaligned(swar_rot13(get_unaligned((const u64 *)(src + i))),
+                      (u64 *)(dst + i));
+
+    for (; i < len; i++) {
+        c = src[i];
+        if ((c >= 'a' && c <= 'm') || (c >= 'A' && c <= 'M'))
+            c += 13;
+        else if ((c >= 'n' && c <= 'z') || (c >= 'N' && c <= 'Z'))
+            c -= 13;
+        dst[i] = c;
+    }
+}
+
+#ifdef CONFIG_X86
+/*
+ * The table lookup splits a 256-entry table into 16 rows of 16 entries,
+ * one per high nibble, and looks every row up with PSHUFB. For row h the
+ * index is b - 16 * h, biased by 0x70 with unsigned saturation: bytes in
+ * the row keep their low nibble and a clear top bit, all others end up
+ * with the top bit set, which makes PSHUFB return 0 for them. OR-ing the
+ * 16 lookups gives the result.
+ */
+static const u8 lut_step[32] __aligned(32) = { [0 ... 31] = 0x10 };
+static const u8 lut_bias[32] __aligned(32) = { [0 ... 31] = 0x70 };
+
+/**
+ * @brief Look up the 64-byte blocks of a span with AVX2
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param table the 256-byte table
+ * @return size_t the number of bytes converted
+ */
+static size_t avx2_lut(char *dst, const char *src, size_t len,
+                       const u8 *table) {
+    u8 rows[16][32] __aligned(32);
+    size_t i;
+    int h, j;
+
+    /* VPSHUFB looks up within each 128-bit lane, so every row is doubled */
+    for (h = 0; h < 16; h++)
+        for (j = 0; j < 32; j++)
+            rows[h][j] = table[h * 16 + (j & 15)];
+
+    asm volatile("vmovdqa %0, %%ymm6" : : "m" (lut_step));
+    asm volatile("vmovdqa %0, %%ymm7" : : "m" (lut_bias));
+
+    /* two blocks at a time, so that the lookups of one hide the other's latency */
+    for (i = 0; i + 64 <= len; i += 64) {
+        asm volatile("vmovdqu %0, %%ymm0\n\t"
+                     "vmovdqu %1, %%ymm8\n\t"
+                     "vpxor %%ymm5, %%ymm5, %%ymm5\n\t"
+                     "vpxor %%ymm9, %%ymm9, %%ymm9"
+                     : : "m" (*(const u8 (*)[32])(src + i)),
+                         "m" (*(const u8 (*)[32])(src + i + 32)));
+        for (h = 0; h < 16; h++)
+            asm volatile("vmovdqa %0, %%ymm2\n\t"
+                         "vpaddusb %%ymm7, %%ymm0, %%ymm1\n\t"
+                         "vpaddusb %%ymm7, %%ymm8, %%ymm10\n\t"
+                         "vpshufb %%ymm1, %%ymm2, %%ymm1\n\t"
+                         "vpshufb %%ymm10, %%ymm2, %%ymm10\n\t"
+                         "vpor %%ymm1, %%ymm5, %%ymm5\n\t"
+                         "vpor %%ymm10, %%ymm9, %%ymm9\n\t"
+                         "vpsubb %%ymm6, %%ymm0, %%ymm0\n\t"
+                         "vpsubb %%ymm6, %%ymm8, %%ymm8"
+                         : : "m" (rows[h]));
+        asm volatile("vmovdqu %%ymm5, %0\n\t"
+                     "vmovdqu %%ymm9, %1"
+                     : "=m" (*(u8 (*)[32])(dst + i)),
+                       "=m" (*(u8 (*)[32])(dst + i + 32)));
+    }
+
+    asm volatile("vzeroupper");
+    return i;
+}
+
+/**
+ * @brief Look up as much of a span as possible with vector instructions
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param table the 256-byte table
+ * @return size_t the number of bytes converted, 0 if SIMD was not used
+ */
+static size_t simd_lut(char *dst, const char *src, size_t len,
+                       const u8 *table) {
+    size_t done;
+
+    if (len < XFORM_SIMD_THRESHOLD || !may_use_simd() ||
+        !static_cpu_has(X86_FEATURE_AVX2) || !static_cpu_has(X86_FEATURE_AVX))
+        return 0;
+
+    kernel_fpu_begin();
+    done = avx2_lut(dst, src, len, table);
+    kernel_fpu_end();
+
+    return done;
+}
+#endif
+
+/**
+ * @brief Map every byte through a 256-byte table
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param table the table of the file
+ */
+static void xform_lut(char *dst, const char *src, size_t len,
+                      const u8 *table) {
+    size_t i = 0;
+
+#ifdef CONFIG_X86
+    i = simd_lut(dst, src, len, table);
+#endif
+    for (; i < len; i++)
+        dst[i] = table[(u8)src[i]];
+}
+
+/* ASCII replacements of the upper half of Latin-1; unknown bytes become '?' */
+static const u8 fold_high[128] = {
+    [0x00 ... 0x1f] = '?',
+    [0x20] = ' ',
+    [0x21 ... 0x3f] = '?',
+    [0x40 ... 0x46] = 'A', [0x47] = 'C', [0x48 ... 0x4b] = 'E',
+    [0x4c ... 0x4f] = 'I', [0x50] = 'D', [0x51] = 'N',
+    [0x52 ... 0x56] = 'O', [0x57] = 'x', [0x58] = 'O',
+    [0x59 ... 0x5c] = 'U', [0x5d] = 'Y', [0x5e] = 'T', [0x5f] = 's',
+    [0x60 ... 0x66] = 'a', [0x67] = 'c', [0x68 ... 0x6b] = 'e',
+    [0x6c ... 0x6f] = 'i', [0x70] = 'd', [0x71] = 'n',
+    [0x72 ... 0x76] = 'o', [0x77] = '/', [0x78] = 'o',
+    [0x79 ... 0x7c] = 'u', [0x7d] = 'y', [0x7e] = 't', [0x7f] = 'y',
+};
+
+/**
+ * @brief Fold Latin-1 text to ASCII
+ *
+ * Words without any byte above 0x7f, the common case for text, are copied
+ * as they are; only the others go through the table.
+ *
+ * @param dst the destination
+ * @param src the source
+ * @param len the number of bytes
+ * @param table unused
+ */
+static void xform_fold(char *dst, const char *src, size_t len,
+                       const u8 *table) {
+    size_t i = 0, j;
+    u8 c;
+    u64 w;
+
+    for (; i + sizeof(u64) <= len; i += sizeof(u64)) {
+        w = get_unaligned((const u64 *)(src + i));
+        if (!(w & (0x80 * ONES))) {
+            put_unaligned(w, (u64 *)(dst + i));
+            continue;
+        }
+        for (j = i; j < i + sizeof(u64); j++) {
+            c = src[j];
+            dst[j] = c & 0x80 ? fold_high[c & 0x7f] : c;
+        }
+    }
+
+    for (; i < len; i++) {
+        c = src[i];
+        dst[i] = c & 0x80 ? fold_high[c & 0x7f] : c;
+    }
+}
+
+static const char hex_digits[16] __aligned(16) = "0123456789abcdef";
+
+#ifdef CONFIG_X86
+static const u8 hex_nibble[16] __aligned(16) = { [0 ... 15] = 0x0f };
+
+/**
+ * @brief Encode the 16-byte blocks of a span as hex with SSSE3
+ *
+ * Both nibbles of every byte are looked up in the digit table with PSHUFB
+ * and the two results are interleaved, high nibble first.
+ *
+ * @param dst the destination, 2 * len bytes
+ * @param src the source
+ * @param len the number of bytes
+ * @return size_t the number of source bytes encoded
+ */
+static size_t ssse3_hex(char *dst, const char *src, size_t len) {
+    size_t i;
+
+    asm volatile("movdqa %0, %%xmm6" : : "m" (hex_digits));
+    asm volatile("movdqa %0, %%xmm7" : : "m" (hex_nibble));
+
+    for (i = 0; i + 16 <= len; i += 16)
+        asm volatile("movdqu %2, %%xmm0\n\t"
+                     "movdqa %%xmm0, %%xmm1\n\t"
+                     "psrlw $4, %%xmm1\n\t"
+                     "pand %%xmm7, %%xmm1\n\t"
+                     "pand %%xmm7, %%xmm0\n\t"
+                     "movdqa %%xmm6, %%xmm2\n\t"
+                     "pshufb %%xmm1, %%xmm2\n\t"
+                     "movdqa %%xmm6, %%xmm3\n\t"
+                     "pshufb %%xmm0, %%xmm3\n\t"
+                     "movdqa %%xmm2, %%xmm4\n\t"
+                     "punpcklbw %%xmm3, %%xmm4\n\t"
+                     "punpckhbw %%xmm3, %%xmm2\n\t"
+                     "movdqu %%xmm4, %0\n\t"
+                     "movdqu %%xmm2, %1"
+                     : "=m" (*(u8 (*)[16])(dst + 2 * i)),
+                       "=m" (*(u8 (*)[16])(dst + 2 * i + 16))
+                     : "m" (*(const u8 (*)[16])(src + i)));
+
+    return i;
+}
+#endif
+
+/**
+ * @brief Encode bytes as lowercase hex, two digits per byte
+ *
+ * @param dst the destination, 2 * len bytes that do not overlap src
+ * @param src the source
+ * @param len the number of bytes
+ * @param table unused
+ */
+static void xform_hex(char *dst, const char *src, size_t len,
+                      const u8 *table) {
+    size_t i = 0;
+
+#ifdef CONFIG_X86
+    if (len >= XFORM_SIMD_THRESHOLD && may_use_simd() &&
+        static_cpu_has(X86_FEATURE_SSSE3)) {
+        kernel_fpu_begin();
+        i = ssse3_hex(dst, src, len);
+        kernel_fpu_end();
+    }
+#endif
+    for (; i < len; i++) {
+        dst[2 * i] = hex_digits[(u8)src[i] >> 4];
+        dst[2 * i + 1] = hex_digits[(u8)src[i] & 0x0f];
+    }
+}
+
+/*
+ * Fused user copies. Modes whose kernel converts each word on its own
+ * transform the words while they are in a register between the user load
+ * and the kernel store, so a byte is read and written once instead of
+ * being copied, then transformed, then copied again. Everything called
+ * inside the user access window must be inlined.
+ */
+
+/**
+ * @brief Convert a kernel span in place with a word kernel
+ *
+ * The bytes of a partial word are padded with zero bytes, which none of
+ * the word kernels changes or carries out of.
+ *
+ * @param buf the span
+ * @param len the number of bytes
+ * @param word the word kernel
+ */
+static __always_inline void word_apply(char *buf, size_t len,
+                                       u64 (*word)(u64)) {
+    size_t i = 0;
+    u64 w = 0;
+
+    for (; i + sizeof(u64) <= len; i += sizeof(u64))
+        put_unaligned(word(get_unaligned((const u64 *)(buf + i))),
+                      (u64 *)(buf + i));
+    if (i < len) {
+        memcpy(&w, buf + i, len - i);
+        w = word(w);
+        memcpy(buf + i, &w, len - i);
+    }
+}
+
+/**
+ * @brief Copy from user memory, converting every word on the way
+ *
+ * Whole words are loaded with unsafe_get_user. The tail, and the rest of
+ * the span after a fault, go through copy_from_user so the result counts
+ * exactly the bytes that could not be read.
+ *
+ * @param dst the kernel destination
+ * @param src the user source
+ * @param len the number of bytes
+ * @param word the word kernel
+ * @return size_t the number of bytes not copied
+ */
+static __always_inline size_t fused_from_user(char *dst,
+                                              const char __user *src,
+                                              size_t len, u64 (*word)(u64)) {
+    size_t done = 0, left;
+    u64 w;
+
+    if (!user_access_begin(src, len))
+        goto rest;
+    for (; done + sizeof(u64) <= len; done += sizeof(u64)) {
+        unsafe_get_user(w, (const u64 __user *)(src + done), fault);
+        put_unaligned(word(w), (u64 *)(dst + done));
+    }
+fault:
+    user_access_end();
+rest:
+    left = copy_from_user(dst + done, src + done, len - done);
+    word_apply(dst + done, len - done - left, word);
+    return left;
+}
+
+/**
+ * @brief Copy to user memory, converting every word on the way
+ *
+ * @param dst the user destination
+ * @param src the kernel source
+ * @param len the number of bytes
+ * @param word the word kernel
+ * @return size_t the number of bytes not copied
+ */
+static __always_inline size_t fused_to_user(char __user *dst, const char *src,
+                                            size_t len, u64 (*word)(u64)) {
+    size_t done = 0, n, left;
+    u64 w;
+
+    if (!user_access_begin(dst, len))
+        goto rest;
+    for (; done + sizeof(u64) <= len; done += sizeof(u64))
+        unsafe_put_user(word(get_unaligned((const u64 *)(src + done))),
+                        (u64 __user *)(dst + done), fault);
+fault:
+    user_access_end();
+rest:
+    while (done < len) {
+        n = min_t(size_t, len - done, sizeof(u64));
+        w = 0;
+        memcpy(&w, src + done, n);
+        w = word(w);
+        left = copy_to_user(dst + done, &w, n);
+        done += n - left;
+        if (left)
+            break;
+    }
+    return len - done;
+}
+
+static __always_inline u64 word_upper(u64 w) {
+    return swar_flip_range(w, 'a', 'z');
+}
+
+static __always_inline u64 word_lower(u64 w) {
+    return swar_flip_range(w, 'A', 'Z');
+}
+
+/* the fused copies of one word kernel */
+#define DEFINE_FUSED(name, word)                                            \
+static size_t name##_from_user(char *dst, const char __user *src,           \
+                               size_t len) {                                \
+    return fused_from_user(dst, src, len, word);                            \
+}                                                                           \
+static size_t name##_to_user(char __user *dst, const char *src,             \
+                             size_t len) {                                  \
+    return fused_to_user(dst, src, len, word);                              \
+}
+
+DEFINE_FUSED(upper, word_upper)
+DEFINE_FUSED(lower, word_lower)
+DEFINE_FUSED(rot13, swar_rot13)
+
+/* the modes of the device, indexed by their HEARTYDEV_* id */
+static const struct xform_ops xform_registry[HEARTYDEV_MAX_MODES] = {
+    [HEARTYDEV_NORMAL] = { "normal", xform_copy, 1, 0 },
+    [HEARTYDEV_UPPER] = { "upper", xform_upper, 1, 0,
+                          upper_from_user, upper_to_user },
+    [HEARTYDEV_LOWER] = { "lower", xform_lower, 1, 0,
+                          lower_from_user, lower_to_user },
+    [HEARTYDEV_ROT13] = { "rot13", xform_rot13, 1, 0,
+                          rot13_from_user, rot13_to_user },
+    [HEARTYDEV_LUT] = { "lut", xform_lut, 1, XFORM_PER_FILE },
+    [HEARTYDEV_FOLD] = { "fold", xform_fold, 1, 0 },
+    [HEARTYDEV_HEX] = { "hex", xform_hex, 2, 0 },
+};
+
+/**
+ * @brief Look up the transform of a mode
+ *
+ * @param mode the mode
+ * @return const struct xform_ops* the transform, or NULL for an unknown mode
+ */
+const struct xform_ops *xform_get(int mode) {
+    if (mode < 0 || mode >= HEARTYDEV_MAX_MODES || !xform_registry[mode].fn)
+        return NULL;
+    return &xform_registry[mode];
+}
+
+/**
+ * @brief Copy from user memory and apply a mode with a ratio of 1
+ *
+ * Modes with fused copies touch each byte once. The others copy first and
+ * convert the bytes in place while they are still in the cache, so the
+ * caller should pass spans that fit in it, such as one page.
+ *
+ * @param ops the transform
+ * @param dst the kernel destination
+ * @param src the user source
+ * @param len the number of bytes
+ * @param table the table of the file
+ * @return size_t the number of bytes not copied
+ */
+size_t xform_from_user(const struct xform_ops *ops, char *dst,
+                       const char __user *src, size_t len, const u8 *table) {
+    size_t left;
+
+    if (ops->from_user)
+        return ops->from_user(dst, src, len);
+    left = copy_from_user(dst, src, len);
+    ops->fn(dst, dst, len - left, table);
+    return left;
+}
@@ -0,0 +1,35 @@
+/**
+ * @file transform.h
+ * @brief Transform kernels for the heartydev driver.
+ *
+ * Every mode of the device is backed by a struct xform_ops. Its kernel
+ * reads len bytes from src and writes len * ratio bytes to dst. For modes
+ * with a ratio of 1, dst may be equal to src to convert in place; the two
+ * buffers must not overlap otherwise. table is the 256-byte lookup table
+ * of the file for modes flagged XFORM_PER_FILE, and unused by the others.
+ */
+
+#ifndef HEARTYDEV_TRANSFORM_H
+#define HEARTYDEV_TRANSFORM_H
+
+#include <linux/compiler_types.h> // for __user
+#include <linux/types.h>    // for size_t
+
+/* the output depends on per-file state, so it cannot be shared or cached */
+#define XFORM_PER_FILE 0x1
+
+struct xform_ops {
+    const char *name;
+    void (*fn)(char *dst, const char *src, size_t len, const u8 *table);
+    unsigned int ratio;     /* output bytes per input byte */
+    unsigned int flags;     /* XFORM_* */
+    /* optional single-pass user copies, returning the bytes not copied */
+    size_t (*from_user)(char *dst, const char __user *src, size_t len);
+    size_t (*to_user)(char __user *dst, const char *src, size_t len);
+};
+
+const struct xform_ops *xform_get(int mode);
+size_t xform_from_user(const struct xform_ops *ops, char *dst,
+                       const char __user *src, size_t len, const u8 *table);
+
+#endif /* HEARTYDEV_TRANSFORM_H */